@@ -0,0 +1,198 @@
+/*
+ * teensy-loader, benchmark regression gate
+ *
+ * compares benchmark results (the json lines printed by bench-ihex -j,
+ * bench-flash -j and bench-enum -j) against the stored baseline for this host class and
+ * fails when a throughput or host overhead metric regresses beyond the
+ * noise threshold. the threshold for each metric is calibrated from the
+ * repeated runs behind both means: a change must exceed both min_pct and
+ * sigma standard errors of the difference to count.
+ *
+ * usage: bench-check [-u] [-k sigma] [-t min_pct] [-b baseline] results.json
+ *	-u : store results as the new baseline (the only way one is written)
+ *	-k : standard errors a change must exceed (default 3)
+ *	-t : minimum relative change in percent (default 5)
+ *	-b : baseline file (default baselines/<host class>.json next to
+ *	     bench-check, or next to results.json when run from $PATH)
+ *
+ * the host class is $BENCH_HOST_CLASS, or <arch>-<cpu model>-<cpus>. a
+ * missing baseline fails the check rather than passing it.
+ *
+ * You may redistribute this program and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software
+ * Foundation, version 3 of the License.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#define MAX_METRICS	4096
+
+struct metric {
+	char	name[128];
+	double	mean, stddev;
+	int32_t	n;
+	bool	higher_is_better;
+};
+
+static struct metric baseline[MAX_METRICS], current[MAX_METRICS];
+
+void die(const char *str) {
+	fprintf(stderr, "%s\n", str);
+	exit(2);
+}
+
+static int32_t load(const char *path, struct metric *m) {
+	char line[512], better[16];
+	int32_t n = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (!fp) return -1;
+	while (n < MAX_METRICS && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "{\"name\":\"%127[^\"]\",\"mean\":%lf,\"stddev\":%lf,\"n\":%d,\"better\":\"%15[^\"]\"}",
+			   m[n].name, &m[n].mean, &m[n].stddev, &m[n].n, better) != 5) continue;
+		m[n].higher_is_better = !strcmp(better, "higher");
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+/* only throughput, per-block host overhead and growth of the loader's indexed lookups gate the build, the rest is informational */
+static bool gated(const char *name) {
+	const char *metric = strrchr(name, '/');
+
+	return metric && (!strcmp(metric, "/MBps") || !strcmp(metric, "/host_us_per_block") ||
+			  (!strcmp(metric, "/growth") && strstr(name, "/index/")));
+}
+
+static void host_class(char *out, size_t len) {
+	char line[256], model[128] = "unknown";
+	struct utsname u;
+	FILE *fp;
+	char *p, *c;
+
+	if ((p = getenv("BENCH_HOST_CLASS")) && *p) {
+		snprintf(out, len, "%s", p);
+		return;
+	}
+	uname(&u);
+	if ((fp = fopen("/proc/cpuinfo", "r"))) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, "model name", 10) || !(p = strchr(line, ':'))) continue;
+			snprintf(model, sizeof(model), "%s", p + 2);
+			break;
+		}
+		fclose(fp);
+	}
+	for (p = model, c = model; *p; p++) {		// lowercase, runs of other characters become '_'
+		if (isalnum((unsigned char) *p)) *c++ = tolower((unsigned char) *p);
+		else if (c > model && c[-1] != '_') *c++ = '_';
+	}
+	while (c > model && c[-1] == '_') c--;
+	*c = '\0';
+	snprintf(out, len, "%s-%s-%ldc", u.machine, model, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/* the directory holding path, "." if it names none */
+static void dir_of(const char *path, char *out, size_t len) {
+	const char *slash = strrchr(path, '/');
+
+	if (!slash) snprintf(out, len, ".");
+	else if (slash == path) snprintf(out, len, "/");
+	else snprintf(out, len, "%.*s", (int)(slash - path), path);
+}
+
+int32_t main(int32_t argc, char **argv) {
+	char cls[256], dir[256], path[1024];
+	const char *baseline_path = NULL, *results;
+	double sigma = 3.0, min_pct = 5.0;
+	int32_t nb, nc, i, regressions = 0, compared = 0;
+	bool update = false;
+	FILE *in, *out;
+	int c;
+
+	while ((c = getopt(argc, argv, "uk:t:b:")) != -1) {
+		switch (c) {
+			case 'u': update = true; break;
+			case 'k': sigma = atof(optarg); break;
+			case 't': min_pct = atof(optarg); break;
+			case 'b': baseline_path = optarg; break;
+			default: die("usage: bench-check [-u] [-k sigma] [-t min_pct] [-b baseline] results.json");
+		}
+	}
+	if (optind != argc - 1) die("usage: bench-check [-u] [-k sigma] [-t min_pct] [-b baseline] results.json");
+	results = argv[optind];
+	if (!baseline_path) {
+		host_class(cls, sizeof(cls));
+		dir_of(strchr(argv[0], '/') ? argv[0] : results, dir, sizeof(dir));
+		snprintf(path, sizeof(path), "%s/baselines", dir);
+		if (update) mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/baselines/%s.json", dir, cls);
+		baseline_path = path;
+	}
+
+	nc = load(results, current);
+	if (nc <= 0) die("no benchmark results to check");
+	nb = update ? -1 : load(baseline_path, baseline);
+	if (nb <= 0 && !update) {
+		fprintf(stderr, "no baseline in \"%s\" for this host class, nothing to check against\n", baseline_path);
+		die("(store one with `make bench-baseline`, or bench-check -u)");
+	}
+	if (update) {
+		if (!(in = fopen(results, "r")) || !(out = fopen(baseline_path, "w"))) die("unable to store baseline");
+		while ((c = fgetc(in)) != EOF) fputc(c, out);
+		fclose(in);
+		fclose(out);
+		printf("stored %d metrics as baseline \"%s\"\n", nc, baseline_path);
+		return 0;
+	}
+
+	printf("baseline \"%s\" (threshold: >%.0f%% and >%.1f standard errors)\n\n", baseline_path, min_pct, sigma);
+	printf("%-48s %12s %12s %8s %8s  %s\n", "metric", "baseline", "current", "change", "noise", "status");
+	for (int32_t k = 0; k < nc; k++) {
+		struct metric *cur = &current[k], *base = NULL;
+		double change, noise, threshold;
+		const char *status;
+
+		if (!gated(cur->name)) continue;
+		for (i = 0; i < nb; i++)
+			if (!strcmp(baseline[i].name, cur->name)) base = &baseline[i];
+		if (!base || base->mean == 0) {
+			printf("%-48s %12s %12.4g %8s %8s  new\n", cur->name, "-", cur->mean, "-", "-");
+			continue;
+		}
+		compared++;
+		change = (cur->mean - base->mean) / base->mean * 100.0;
+		noise = sigma * sqrt(base->stddev * base->stddev / base->n + cur->stddev * cur->stddev / cur->n)
+			/ base->mean * 100.0;
+		threshold = noise > min_pct ? noise : min_pct;
+		if ((cur->higher_is_better ? -change : change) > threshold) {
+			status = "REGRESSED";
+			regressions++;
+		} else if ((cur->higher_is_better ? change : -change) > threshold) {
+			status = "improved";
+		} else {
+			status = "ok";
+		}
+		printf("%-48s %12.4g %12.4g %+7.1f%% %7.1f%%  %s\n", cur->name, base->mean, cur->mean, change, noise, status);
+	}
+	for (i = 0; i < nb; i++) {
+		bool found = false;
+		if (!gated(baseline[i].name)) continue;
+		for (int32_t k = 0; k < nc && !found; k++) found = !strcmp(baseline[i].name, current[k].name);
+		if (!found) printf("%-48s %12.4g %12s %8s %8s  missing\n", baseline[i].name, baseline[i].mean, "-", "-", "-");
+	}
+
+	printf("\n%d metrics compared, %d regressed\n", compared, regressions);
+	if (regressions) printf("(if the slowdown is intended, refresh the baseline with `make bench-baseline`)\n");
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * teensy-loader, usb enumeration scalability benchmark
+ *
+ * builds a synthetic sysfs and device tree with N usb devices, M of them
+ * Teensys (alternately waiting in HalfKay and running usb serial code, the
+ * rest keyboards and storage), points sysfs_root and dev_root at it and
+ * times, for growing N, the lookups the loader makes:
+ *	discover	 : find and open every HalfKay hidraw node
+ *	locate		 : resolve a board's bus address to its port path and serial
+ *	wait_poll	 : one hidraw wait loop poll that finds no HalfKay
+ *	wait_poll_libusb : one libusb wait loop poll that finds no HalfKay
+ *	reboot_target	 : find the usb serial Teensy a soft reboot is sent to
+ * each lookup is timed with the code teensy-loader.c runs ("index") and
+ * with a scan that reads attributes of every device ("scan"). libusb cannot
+ * be pointed at a synthetic tree, so its enumeration is modeled by the scan:
+ * wait_poll_libusb/index is the loader's usbfs watch in front of it, and
+ * reboot_target, which the loader does once per soft reboot with a plain
+ * enumeration, only has the scan. besides the cost per lookup, the growth
+ * from the smallest to the largest N is reported: an index that quietly
+ * became a scan shows up there.
+ *
+ * usage: bench-enum [-r runs] [-j] [-m teensys] [N ...]
+ *	-m : Teensys in the tree (default 4)
+ *	N  : device counts to test (default 16 64 256 1024)
+ *
+ * You may redistribute this program and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software
+ * Foundation, version 3 of the License.
+*/
+
+#define TEENSY_LOADER_NO_MAIN
+#include "../teensy-loader.c"
+#include "bench-util.c"
+
+#include <ftw.h>
+
+#define USAGE		"usage: bench-enum [-r runs] [-j] [-m teensys] [N ...]"
+#define MAX_SIZES	8
+#define OPS_PER_RUN	50	// lookups per timed run
+
+enum kernel { K_DISCOVER, K_LOCATE, K_WAIT_POLL, K_WAIT_POLL_LIBUSB, K_REBOOT_TARGET, K_COUNT };
+static const char *kernel_names[K_COUNT] = { "discover", "locate", "wait_poll", "wait_poll_libusb", "reboot_target" };
+static const char *strategy_names[2] = { "index", "scan" };
+
+static int32_t	teensys = 4;
+static char	tree[64];
+static int32_t	locate_bus, locate_dev;	// bus address of the last Teensy in the tree
+
+static int32_t enum_options(int32_t argc, char **argv, int32_t i) {
+	if (i + 1 >= argc || strcmp(argv[i], "-m")) return 0;
+	teensys = atoi(argv[i + 1]);
+	return i + 1;
+}
+
+
+/************************/
+/*    Synthetic Tree    */
+/************************/
+
+static void tree_path(char *out, size_t len, const char *fmt, va_list ap) {
+	int32_t n = snprintf(out, len, "%s/", tree);
+
+	vsnprintf(out + n, len - n, fmt, ap);
+}
+
+/* mkdir -p of a path under the tree */
+static void tree_mkdir(const char *fmt, ...) {
+	char path[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	tree_path(path, sizeof(path), fmt, ap);
+	va_end(ap);
+	for (char *p = path + 1; *p; p++) {
+		if (*p != '/') continue;
+		*p = '\0';
+		mkdir(path, 0755);
+		*p = '/';
+	}
+	if (mkdir(path, 0755) && errno != EEXIST) die("unable to create %s: %s", path, strerror(errno));
+}
+
+static void tree_file(const char *name, const char *content) {
+	char path[1024];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", tree, name);
+	if (!(fp = fopen(path, "w"))) die("unable to create %s: %s", path, strerror(errno));
+	fputs(content, fp);
+	fclose(fp);
+}
+
+static void tree_link(const char *target, const char *name) {
+	char from[1024], to[1024];
+
+	snprintf(from, sizeof(from), "%s/%s", tree, target);
+	snprintf(to, sizeof(to), "%s/%s", tree, name);
+	if (symlink(from, to)) die("unable to link %s: %s", to, strerror(errno));
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void) st; (void) flag; (void) ftw;
+	return remove(path);
+}
+
+static void tree_remove(void) {
+	nftw(tree, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+*  lay out n devices the way sysfs does: device directories under
+*  devices/usbB, with bus/usb/devices, dev/char, bus/hid/devices and
+*  class/hidraw linking into them, plus the usbfs and hidraw nodes under
+*  dev. Teensys are spread evenly.
+*/
+static void tree_build(int32_t n) {
+	char port[32], dir[128], iface[192], hid[256], name[320], val[128];
+	int32_t bus, devnum, vid, pid, hid_id = 0, hidraw = 0, teensy = 0;
+	bool is_hid;
+
+	snprintf(tree, sizeof(tree), "/tmp/bench-enum-%d", (int) getpid());
+	tree_remove();
+	tree_mkdir("sys/bus/usb/devices");
+	tree_mkdir("sys/bus/hid/devices");
+	tree_mkdir("sys/class/hidraw");
+	tree_mkdir("sys/dev/char");
+	for (int32_t i = 0; i < n; i++) {
+		bus = 1 + i / 100;
+		devnum = 2 + i % 100;
+		snprintf(port, sizeof(port), "%d-%d.%d", bus, 1 + (i % 100) / 10, 1 + i % 10);
+		snprintf(dir, sizeof(dir), "sys/devices/usb%d/%s", bus, port);
+		snprintf(iface, sizeof(iface), "%s/%s:1.0", dir, port);
+		tree_mkdir("%s", iface);
+		tree_mkdir("dev/bus/usb/%03d", bus);
+
+		if (teensy < teensys && (int64_t) i * teensys / n != (int64_t)(i + 1) * teensys / n) {
+			vid = 0x16C0;
+			pid = teensy % 2 ? 0x0483 : 0x0478;	// running usb serial, or waiting in HalfKay
+			locate_bus = bus;
+			locate_dev = devnum;
+			teensy++;
+		} else if (i % 4 == 0) {
+			vid = 0x046D;	// keyboard
+			pid = 0xC52B;
+		} else {
+			vid = 0x0BDA;	// storage
+			pid = 0x8153;
+		}
+		is_hid = pid == 0x0478 || pid == 0xC52B;
+
+		snprintf(name, sizeof(name), "%s/busnum", dir);
+		snprintf(val, sizeof(val), "%d\n", bus);
+		tree_file(name, val);
+		snprintf(name, sizeof(name), "%s/devnum", dir);
+		snprintf(val, sizeof(val), "%d\n", devnum);
+		tree_file(name, val);
+		snprintf(name, sizeof(name), "%s/idVendor", dir);
+		snprintf(val, sizeof(val), "%04x\n", vid);
+		tree_file(name, val);
+		snprintf(name, sizeof(name), "%s/idProduct", dir);
+		snprintf(val, sizeof(val), "%04x\n", pid);
+		tree_file(name, val);
+		snprintf(name, sizeof(name), "%s/serial", dir);
+		snprintf(val, sizeof(val), "%d\n", 10000 + i);
+		tree_file(name, val);
+		snprintf(name, sizeof(name), "sys/bus/usb/devices/%s", port);
+		tree_link(dir, name);
+		snprintf(name, sizeof(name), "sys/bus/usb/devices/%s:1.0", port);
+		tree_link(iface, name);
+		snprintf(name, sizeof(name), "sys/dev/char/%d:%d", USB_DEVICE_MAJOR, (bus - 1) * 128 + devnum - 1);
+		tree_link(dir, name);
+		snprintf(name, sizeof(name), "dev/bus/usb/%03d/%03d", bus, devnum);
+		tree_file(name, "");
+
+		if (!is_hid) continue;
+		snprintf(hid, sizeof(hid), "%s/0003:%04X:%04X.%04X", iface, vid, pid, ++hid_id);
+		tree_mkdir("%s/hidraw/hidraw%d", hid, hidraw);
+		snprintf(name, sizeof(name), "%s/uevent", hid);
+		snprintf(val, sizeof(val), "DRIVER=hid-generic\nHID_ID=0003:%08X:%08X\n", vid, pid);
+		tree_file(name, val);
+		snprintf(name, sizeof(name), "%s/hidraw/hidraw%d/device", hid, hidraw);
+		tree_link(hid, name);
+		snprintf(name, sizeof(name), "%s/hidraw/hidraw%d", hid, hidraw);
+		snprintf(val, sizeof(val), "sys/class/hidraw/hidraw%d", hidraw);
+		tree_link(name, val);
+		snprintf(name, sizeof(name), "sys/bus/hid/devices/0003:%04X:%04X.%04X", vid, pid, hid_id);
+		tree_link(hid, name);
+		snprintf(name, sizeof(name), "dev/hidraw%d", hidraw++);
+		tree_file(name, "");
+	}
+	snprintf(val, sizeof(val), "%s/sys", tree);
+	sysfs_root = strdup(val);
+	snprintf(val, sizeof(val), "%s/dev", tree);
+	dev_root = strdup(val);
+}
+
+
+/*************************/
+/*    Scan Strategies    */
+/*************************/
+
+/* hidraw discovery by reading the uevent of every hidraw node */
+static int32_t scan_discover(int32_t vid, int32_t pid, struct hidraw_dev *devs, int32_t max) {
+	char root[512], path[1024], uevent[1024], want[32], *id;
+	struct dirent *de;
+	int32_t n = 0;
+	DIR *d;
+
+	snprintf(root, sizeof(root), "%s/class/hidraw", sysfs_root);
+	if (!(d = opendir(root))) return 0;
+	snprintf(want, sizeof(want), "HID_ID=0003:%08X:%08X", vid, pid);
+	while (n < max && (de = readdir(d))) {
+		if (strncmp(de->d_name, "hidraw", 6)) continue;
+		snprintf(path, sizeof(path), "%s/%s/device", root, de->d_name);
+		if (!read_sysfs_attr(path, "uevent", uevent, sizeof(uevent))) continue;
+		if (!(id = strstr(uevent, want)) || (id[strlen(want)] && id[strlen(want)] != '\n')) continue;
+		hidraw_usb_address(path, &devs[n]);
+		snprintf(path, sizeof(path), "%s/%s", dev_root, de->d_name);
+		if ((devs[n].fd = open(path, O_RDWR | O_CLOEXEC)) >= 0) n++;
+	}
+	closedir(d);
+	return n;
+}
+
+/* devices with vid:pid, reading the ids of every usb device (what a libusb enumeration does) */
+static int32_t scan_usb_ids(int32_t vid, int32_t pid) {
+	char root[512], dir[768], val[16], want[2][8];
+	struct dirent *de;
+	int32_t n = 0;
+	DIR *d;
+
+	snprintf(root, sizeof(root), "%s/bus/usb/devices", sysfs_root);
+	if (!(d = opendir(root))) return 0;
+	snprintf(want[0], sizeof(want[0]), "%04x", vid);
+	snprintf(want[1], sizeof(want[1]), "%04x", pid);
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' || strchr(de->d_name, ':')) continue;
+		snprintf(dir, sizeof(dir), "%s/%s", root, de->d_name);
+		if (!read_sysfs_attr(dir, "idVendor", val, sizeof(val)) || strcmp(val, want[0])) continue;
+		if (!read_sysfs_attr(dir, "idProduct", val, sizeof(val)) || strcmp(val, want[1])) continue;
+		n++;
+	}
+	closedir(d);
+	return n;
+}
+
+
+/********************/
+/*    Benchmarks    */
+/********************/
+
+/* reboot_target has no index: the loader enumerates for it once per soft reboot */
+static bool has_strategy(enum kernel k, int32_t strategy) {
+	return strategy || k != K_REBOOT_TARGET;
+}
+
+/* one lookup of kernel k with strategy (0 index, 1 scan); returns what it found */
+static int32_t lookup(enum kernel k, int32_t strategy) {
+	struct hidraw_dev devs[SYNC_BOOT_MAX];
+	char dir[PATH_MAX];
+	int32_t n = 0;
+
+	switch (k) {
+	case K_DISCOVER:
+	case K_WAIT_POLL:	// polls for the rebootor, which the tree does not have
+		n = (strategy ? scan_discover : hidraw_open_devices)(0x16C0, k == K_DISCOVER ? 0x0478 : 0x0477,
+			devs, SYNC_BOOT_MAX);
+		for (int32_t i = 0; i < n; i++) hidraw_close(&devs[i]);
+		return n;
+	case K_LOCATE:
+		return (strategy ? usb_device_dir_scan : usb_device_dir)(locate_bus, locate_dev, dir, sizeof(dir));
+	case K_WAIT_POLL_LIBUSB:	// open_usb_devices, with the enumeration modeled by the scan
+		if (!strategy && !usb_may_appear(0x16C0, 0x0477)) return 0;
+		n = scan_usb_ids(0x16C0, 0x0477);
+		if (!strategy && !n) usb_note_absent(0x16C0, 0x0477);
+		return n;
+	case K_REBOOT_TARGET:
+		return scan_usb_ids(0x16C0, 0x0483);
+	default:
+		return 0;
+	}
+}
+
+int32_t main(int32_t argc, char **argv) {
+	static struct sample_set sets[K_COUNT][2][MAX_SIZES];
+	int32_t first = bench_options(argc, argv, USAGE, enum_options);
+	int32_t sizes[MAX_SIZES] = { 16, 64, 256, 1024 }, nsizes = 4, expect;
+	double v[BENCH_MAX_RUNS];
+	char variant[16];
+
+	if (first < argc) {
+		for (nsizes = 0; first < argc && nsizes < MAX_SIZES; first++) sizes[nsizes++] = atoi(argv[first]);
+	}
+	if (teensys < 2) die("%s", USAGE);
+	for (int32_t s = 0; s < nsizes; s++) {
+		if (sizes[s] < teensys) die("every tree needs at least %d devices", teensys);
+	}
+
+	if (!json) printf("  %-22s %-16s %-9s %12s\n", "lookup", "strategy", "devices", "mean");
+	for (int32_t s = 0; s < nsizes; s++) {
+		tree_build(sizes[s]);
+		snprintf(variant, sizeof(variant), "N=%d", sizes[s]);
+		for (int32_t k = 0; k < K_COUNT; k++) {
+			expect = k == K_DISCOVER ? (teensys + 1) / 2 : k == K_REBOOT_TARGET ? teensys / 2 : k == K_LOCATE;
+			for (int32_t st = 0; st < 2; st++) {
+				if (!has_strategy(k, st)) continue;
+				if (lookup(k, st) != expect)
+					die("%s/%s found the wrong devices in %s", kernel_names[k], strategy_names[st], tree);
+				TIME_RUNS(&sets[k][st][s], for (int32_t i = 0; i < OPS_PER_RUN; i++) lookup(k, st));
+				for (int32_t r = 0; r < runs; r++) v[r] = sets[k][st][s].seconds[r] * 1e6 / OPS_PER_RUN;
+				report(kernel_names[k], strategy_names[st], variant, "us_per_op", false, v, runs);
+			}
+		}
+		tree_file("dev/bus/usb/001/199", "");	// a device plugged in must end the skipped polls
+		if (!usb_may_appear(0x16C0, 0x0477)) die("wait_poll_libusb/index missed a new device in %s", tree);
+	}
+	tree_remove();
+
+	if (nsizes < 2) return 0;
+	snprintf(variant, sizeof(variant), "N=%d-%d", sizes[0], sizes[nsizes - 1]);
+	for (int32_t k = 0; k < K_COUNT; k++) {
+		for (int32_t st = 0; st < 2; st++) {
+			if (!has_strategy(k, st)) continue;
+			for (int32_t r = 0; r < runs; r++)
+				v[r] = sets[k][st][nsizes - 1].seconds[r] / sets[k][st][0].seconds[r];
+			report(kernel_names[k], strategy_names[st], variant, "growth", false, v, runs);
+		}
+	}
+	return 0;
+}
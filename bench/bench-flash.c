@@ -0,0 +1,106 @@
+/*
+ * teensy-loader, end-to-end flash pipeline benchmark
+ *
+ * runs parse, plan, open, erase, program and boot against the simulated
+ * HalfKay in halfkay-sim.c for each mcu family and a range of image
+ * densities, and reports wall time, host overhead per block (time not
+ * spent waiting on the device) and cpu usage.
+ *
+ * usage: bench-flash [-r runs] [-j] [-s scale] [-E erase_us] [-P block_us] [-J jitter_us] [mcu ...]
+ *	-s : scale the per-mcu timing model in MCUs[] (default 0.01)
+ *	-E : fixed erase latency in microseconds (overrides -s)
+ *	-P : fixed per-block latency in microseconds (overrides -s)
+ *	-J : uniform jitter in microseconds added to every device wait
+ *
+ * You may redistribute this program and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software
+ * Foundation, version 3 of the License.
+*/
+
+#define TEENSY_LOADER_NO_MAIN
+#include "../teensy-loader.c"
+#include "halfkay-sim.c"
+#include "bench-util.c"
+
+#define USAGE "usage: bench-flash [-r runs] [-j] [-s scale] [-E erase_us] [-P block_us] [-J jitter_us] [mcu ...]"
+
+/* one representative per HalfKay packet format and flash family */
+static const char *families[] = {
+	"atmega32u4", "at90usb1286", "mkl26z64", "mk20dx256", "mk66fx1m0", "imxrt1062", NULL
+};
+static const int32_t densities[] = { 5, 25, 50, 90, 0 };
+
+static double	scale = 0.01;
+static int32_t	fixed_erase_us = -1, fixed_block_us = -1;
+
+static int32_t flash_options(int32_t argc, char **argv, int32_t i) {
+	if (i + 1 >= argc) return 0;
+	if (!strcmp(argv[i], "-s")) scale = atof(argv[i + 1]);
+	else if (!strcmp(argv[i], "-E")) fixed_erase_us = atoi(argv[i + 1]);
+	else if (!strcmp(argv[i], "-P")) fixed_block_us = atoi(argv[i + 1]);
+	else if (!strcmp(argv[i], "-J")) sim_jitter_us = atoi(argv[i + 1]);
+	else return 0;
+	return i + 1;
+}
+
+static double cpu_seconds(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void bench_family(const char *mcu) {
+	double wall[BENCH_MAX_RUNS], overhead[BENCH_MAX_RUNS], cpu[BENCH_MAX_RUNS];
+	uint8_t buf[2048];
+	char path[64], variant[16];
+	uint64_t t, program_ns;
+	double c;
+
+	read_mcu((char *) mcu);
+	sim_erase_us = fixed_erase_us >= 0 ? fixed_erase_us : (int32_t)(erase_ms * 1000 * scale);
+	sim_block_us = fixed_block_us >= 0 ? fixed_block_us : (int32_t)(block_us * scale);
+
+	for (int32_t d = 0; densities[d]; d++) {
+		snprintf(path, sizeof(path), "/tmp/bench-flash-%d.hex", (int) getpid());
+		snprintf(variant, sizeof(variant), "%d%%", densities[d]);
+		generate_hex(path, ORDER_SORTED, densities[d]);
+
+		for (int32_t run = -1; run < runs; run++) {	// run -1 warms up
+			memset(&timings, 0, sizeof(timings));
+			timings.start_ns = t = monotonic_ns();
+			c = cpu_seconds();
+			sim_device_ns = 0;
+
+			if (ihex_read(path) < 0) die("generated file failed to parse");
+			open_halfkay();
+			program_ns = monotonic_ns();
+			program_blocks(buf);
+			program_ns = monotonic_ns() - program_ns;
+			teensy_boot(buf, build_block_packet(0, buf));
+			teensy_close();
+
+			if (run < 0) continue;
+			wall[run] = (double)(monotonic_ns() - t) / 1e9;
+			cpu[run] = (cpu_seconds() - c) / wall[run] * 100.0;
+			overhead[run] = (double)(program_ns - sim_device_ns) / 1e3 / timings.blocks_written;
+		}
+		report("flash", mcu, variant, "wall_s", false, wall, runs);
+		report("flash", mcu, variant, "host_us_per_block", false, overhead, runs);
+		report("flash", mcu, variant, "cpu_percent", false, cpu, runs);
+		unlink(path);
+	}
+}
+
+int32_t main(int32_t argc, char **argv) {
+	int32_t first = bench_options(argc, argv, USAGE, flash_options);
+
+	health_db = "off";
+	if (!json) printf("  %-22s %-16s %-9s %12s\n", "pipeline", "mcu", "density", "mean");
+	if (first < argc) {
+		for (int32_t i = first; i < argc; i++) bench_family(argv[i]);
+	} else {
+		for (int32_t i = 0; families[i]; i++) bench_family(families[i]);
+	}
+	return 0;
+}
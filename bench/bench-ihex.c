@@ -0,0 +1,127 @@
+/*
+ * teensy-loader, intel hex parser and image kernel microbenchmarks
+ *
+ * generates synthetic hex files for every distinct entry in MCUs[] (sparse,
+ * dense, unsorted and extended-address-heavy layouts) and times ihex_read,
+ * ihex_parse_line, ihex_bytes_in_range, ihex_memory_is_blank and
+ * ihex_get_data over repeated runs.
+ *
+ * usage: bench-ihex [-r runs] [-j] [mcu ...]
+ *	-r : repetitions per kernel (default 5)
+ *	-j : print one json line per metric instead of a table
+ *
+ * You may redistribute this program and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software
+ * Foundation, version 3 of the License.
+*/
+
+#define TEENSY_LOADER_NO_MAIN
+#include "../teensy-loader.c"
+
+#include "bench-util.c"
+
+static const struct {
+	const char *name;
+	enum hex_order order;
+	int32_t density;
+} patterns[] = {
+	{"sparse",	ORDER_SORTED,	12},
+	{"dense",	ORDER_SORTED,	90},
+	{"unsorted",	ORDER_UNSORTED,	90},
+	{"extended",	ORDER_EXTENDED,	90},
+	{NULL, 0, 0},
+};
+
+static void report_set(const char *kernel, const char *mcu, const char *pattern,
+		       const struct sample_set *s, double bytes, double records) {
+	double v[BENCH_MAX_RUNS];
+
+	for (int32_t i = 0; i < s->n; i++) v[i] = bytes / s->seconds[i] / 1e6;
+	report(kernel, mcu, pattern, "MBps", true, v, s->n);
+	if (records > 0) {
+		for (int32_t i = 0; i < s->n; i++) v[i] = s->seconds[i] * 1e9 / records;
+		report(kernel, mcu, pattern, "ns_per_record", false, v, s->n);
+	}
+#ifdef HAVE_TSC
+	for (int32_t i = 0; i < s->n; i++) v[i] = s->cycles[i] / bytes;
+	report(kernel, mcu, pattern, "cycles_per_byte", false, v, s->n);
+#endif
+}
+
+
+/***************************/
+/*    Kernel Benchmarks    */
+/***************************/
+
+static char **load_lines(const char *path, int32_t *count, long *size) {
+	char line[1024], **lines;
+	int32_t n = 0, cap = 1024;
+	FILE *fp = fopen(path, "r");
+
+	*size = 0;
+	lines = malloc(sizeof(char *) * cap);
+	while (fgets(line, sizeof(line), fp)) {
+		if (n == cap) lines = realloc(lines, sizeof(char *) * (cap *= 2));
+		lines[n++] = strdup(line);
+		*size += strlen(line);
+	}
+	fclose(fp);
+	*count = n;
+	return lines;
+}
+
+static void bench_mcu(const char *mcu) {
+	static uint8_t block[1024];
+	char path[64];
+	struct sample_set s;
+	volatile int32_t sink = 0;
+	int32_t records, nlines;
+	long file_size;
+	char **lines;
+
+	for (int32_t p = 0; patterns[p].name; p++) {
+		snprintf(path, sizeof(path), "/tmp/bench-ihex-%d.hex", (int) getpid());
+		records = generate_hex(path, patterns[p].order, patterns[p].density);
+		lines = load_lines(path, &nlines, &file_size);
+
+		TIME_RUNS(&s, if (ihex_read(path) < 0) die("generated file failed to parse"));
+		report_set("ihex_read", mcu, patterns[p].name, &s, file_size, records);
+
+		TIME_RUNS(&s, {
+			extended_addr = 0;
+			for (int32_t i = 0; i < nlines; i++) sink += ihex_parse_line(lines[i]);
+		});
+		report_set("ihex_parse_line", mcu, patterns[p].name, &s, file_size, nlines);
+
+		TIME_RUNS(&s, for (int32_t a = 0; a < code_size; a += block_size)
+			sink += ihex_bytes_in_range(a, a + block_size - 1));
+		report_set("ihex_bytes_in_range", mcu, patterns[p].name, &s, code_size, 0);
+
+		TIME_RUNS(&s, for (int32_t a = 0; a < code_size; a += block_size)
+			sink += ihex_memory_is_blank(a, block_size));
+		report_set("ihex_memory_is_blank", mcu, patterns[p].name, &s, code_size, 0);
+
+		TIME_RUNS(&s, for (int32_t a = 0; a < code_size; a += block_size) {
+			ihex_get_data(a, block_size, block);
+			sink += block[0];
+		});
+		report_set("ihex_get_data", mcu, patterns[p].name, &s, code_size, 0);
+
+		for (int32_t i = 0; i < nlines; i++) free(lines[i]);
+		free(lines);
+		unlink(path);
+	}
+	(void) sink;
+}
+
+int32_t main(int32_t argc, char **argv) {
+	int32_t first_mcu = bench_options(argc, argv, "usage: bench-ihex [-r runs] [-j] [mcu ...]", NULL);
+
+	if (!json) printf("  %-22s %-16s %-9s %12s\n", "kernel", "mcu", "pattern", "mean");
+	for (int32_t m = 0; MCUs[m].name != NULL; m++) {
+		if (!bench_wants_mcu(m, argv + first_mcu, argc - first_mcu)) continue;
+		read_mcu((char *) MCUs[m].name);
+		bench_mcu(MCUs[m].name);
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * teensy-loader, shared benchmark helpers
+ *
+ * statistics, reporting and synthetic intel hex generation for the
+ * benchmarks in this directory. included after teensy-loader.c.
+ *
+ * You may redistribute this program and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software
+ * Foundation, version 3 of the License.
+*/
+
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define BENCH_MAX_RUNS	100
+
+enum hex_order { ORDER_SORTED, ORDER_UNSORTED, ORDER_EXTENDED };
+
+struct sample_set {
+	int32_t n;
+	double	seconds[BENCH_MAX_RUNS];
+	double	cycles[BENCH_MAX_RUNS];
+};
+
+static int32_t	runs = 5;
+static bool	json = false;
+
+
+/************************/
+/*    Timing & Stats    */
+/************************/
+
+static inline uint64_t cycles_now(void) {
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* two-sided 95% student t quantiles for 1..30 degrees of freedom */
+static double t95(int32_t df) {
+	static const double t[] = { 0, 12.71, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+		2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080,
+		2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	if (df < 1) return 0;
+	return df <= 30 ? t[df] : 1.96;
+}
+
+static void stats(const double *v, int32_t n, double *mean, double *sd) {
+	double sum = 0, sq = 0;
+
+	for (int32_t i = 0; i < n; i++) sum += v[i];
+	*mean = sum / n;
+	for (int32_t i = 0; i < n; i++) sq += (v[i] - *mean) * (v[i] - *mean);
+	*sd = n > 1 ? sqrt(sq / (n - 1)) : 0;
+}
+
+/* report the mean and 95% confidence interval of one derived metric */
+static void report(const char *kernel, const char *mcu, const char *variant, const char *metric,
+		   bool higher_is_better, const double *values, int32_t n) {
+	double mean, sd, ci;
+
+	stats(values, n, &mean, &sd);
+	ci = t95(n - 1) * sd / sqrt(n);
+	if (json) {
+		printf("{\"name\":\"%s/%s/%s/%s\",\"mean\":%.6g,\"stddev\":%.6g,\"n\":%d,\"better\":\"%s\"}\n",
+			kernel, mcu, variant, metric, mean, sd, n, higher_is_better ? "higher" : "lower");
+	} else {
+		printf("  %-22s %-16s %-9s %12.3f %-15s +/- %.3f (95%% ci)\n",
+			kernel, mcu, variant, mean, metric, ci);
+	}
+	fflush(stdout);
+}
+
+/* run body once to warm caches and page tables, then time it runs times */
+#define TIME_RUNS(set, body) do {					\
+	(set)->n = 0;							\
+	for (int32_t run_ = -1; run_ < runs; run_++) {			\
+		uint64_t t_ = monotonic_ns(), c_ = cycles_now();	\
+		body;							\
+		if (run_ < 0) continue;					\
+		(set)->cycles[run_] = (double)(cycles_now() - c_);	\
+		(set)->seconds[run_] = (double)(monotonic_ns() - t_) / 1e9; \
+		(set)->n++;						\
+	}								\
+} while (0)
+
+/*
+*  parse the common [-r runs] [-j] options; extra (if given) handles any
+*  other option at argv[i] and returns the index of its last argument, or 0
+*  if it does not know it. returns the index of the first operand.
+*/
+static int32_t bench_options(int32_t argc, char **argv, const char *usage_line,
+			     int32_t (*extra)(int32_t argc, char **argv, int32_t i)) {
+	int32_t i, j;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-j")) json = true;
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc) runs = atoi(argv[++i]);
+		else if (extra && (j = extra(argc, argv, i))) i = j;
+		else die("%s", usage_line);
+	}
+	if (runs < 2 || runs > BENCH_MAX_RUNS) die("runs must be between 2 and %d", BENCH_MAX_RUNS);
+	return i;
+}
+
+/* true for the first MCUs[] entry of each geometry, or for entries named on the command line */
+static inline bool bench_wants_mcu(int32_t m, char **names, int32_t count) {
+	for (int32_t i = 0; i < count; i++)
+		if (!strcasecmp(names[i], MCUs[m].name)) return true;
+	if (count) return false;
+	for (int32_t i = 0; i < m; i++)		// skip pretty-name duplicates
+		if (MCUs[i].code_size == MCUs[m].code_size && MCUs[i].block_size == MCUs[m].block_size)
+			return false;
+	return true;
+}
+
+
+/**********************************/
+/*    Synthetic Hex Generation    */
+/**********************************/
+
+static void hex_record(FILE *fp, int32_t len, int32_t addr, int32_t type, const uint8_t *data) {
+	int32_t sum = len + ((addr >> 8) & 255) + (addr & 255) + type;
+
+	fprintf(fp, ":%02X%04X%02X", len, addr & 0xFFFF, type);
+	for (int32_t i = 0; i < len; i++) {
+		fprintf(fp, "%02X", data[i]);
+		sum += data[i];
+	}
+	fprintf(fp, "%02X\n", (-sum) & 255);
+}
+
+static void hex_extended(FILE *fp, uint32_t addr) {
+	uint8_t upper[2] = { (addr >> 24) & 255, (addr >> 16) & 255 };
+
+	hex_record(fp, 2, 0, 4, upper);
+}
+
+/*
+*  write a synthetic image for the current mcu with density percent of its
+*  blocks populated (spread evenly) in 16 byte records, returns the number
+*  of records. one record in seven is all 0xFF.
+*/
+static inline int32_t generate_hex(const char *path, enum hex_order order, int32_t density) {
+	uint32_t base = (code_size > 1048576 && block_size >= 1024) ? 0x60000000 : 0;
+	int32_t nrec = 0, step = 16, records = 0;
+	uint32_t *addrs, upper = 0xFFFFFFFF;
+	uint8_t data[16];
+	FILE *fp;
+
+	addrs = malloc(sizeof(uint32_t) * (code_size / step + 1));
+	for (int32_t b = 0; b < code_size / block_size; b++) {
+		if ((int64_t) b * density / 100 == (int64_t)(b + 1) * density / 100) continue;
+		for (int32_t a = b * block_size; a < (b + 1) * block_size; a += step)
+			addrs[nrec++] = a;
+	}
+	if (order == ORDER_UNSORTED) {
+		srand(1);
+		for (int32_t i = nrec - 1; i > 0; i--) {
+			int32_t j = rand() % (i + 1);
+			uint32_t x = addrs[i]; addrs[i] = addrs[j]; addrs[j] = x;
+		}
+	}
+
+	fp = fopen(path, "w");
+	if (!fp) die("unable to write \"%s\"", path);
+	for (int32_t i = 0; i < nrec; i++) {
+		uint32_t addr = addrs[i] + base;
+		if (order == ORDER_EXTENDED || (addr >> 16) != upper) {
+			hex_extended(fp, addr);
+			upper = addr >> 16;
+			records++;
+		}
+		for (int32_t b = 0; b < step; b++)
+			data[b] = (addrs[i] / step) % 7 == 0 ? 0xFF : (uint8_t)(addrs[i] * 31 + b * 7);
+		hex_record(fp, step, addr & 0xFFFF, 0, data);
+		records++;
+	}
+	hex_record(fp, 0, 0, 1, NULL);
+	fclose(fp);
+	free(addrs);
+	return records + 1;
+}
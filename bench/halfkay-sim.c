@@ -0,0 +1,84 @@
+/*
+ * teensy-loader, simulated HalfKay usb backend
+ *
+ * stands in for the libusb backend (build with -DUSE_SIMULATOR) so the
+ * complete flash pipeline can be timed without hardware. the first block
+ * after open takes sim_erase_us, every further block sim_block_us, each
+ * with up to +/- sim_jitter_us of uniform jitter. time spent waiting on the
+ * simulated device is accumulated in sim_device_ns so host overhead can
+ * be separated from device time.
+ *
+ * You may redistribute this program and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software
+ * Foundation, version 3 of the License.
+*/
+
+static int32_t	sim_erase_us	= 0;
+static int32_t	sim_block_us	= 0;
+static int32_t	sim_jitter_us	= 0;
+static uint64_t	sim_device_ns	= 0;
+static int32_t	sim_packets	= 0;
+static bool	sim_is_open	= false;
+static bool	sim_erased	= false;
+static uint32_t	sim_seed	= 1;
+
+static void sim_busy(int64_t us) {
+	struct timespec ts;
+	uint64_t t = monotonic_ns();
+
+	if (sim_jitter_us) us += (int64_t)(rand_r(&sim_seed) % (2 * sim_jitter_us + 1)) - sim_jitter_us;
+	if (us > 0) {
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = (us % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+	sim_device_ns += monotonic_ns() - t;
+}
+
+int32_t teensy_open(void) {
+	sim_is_open = true;
+	sim_erased = false;
+	return 1;
+}
+
+int32_t teensy_write(void *buf, int32_t len, double timeout) {
+	const uint8_t *p = buf;
+
+	(void) timeout;
+	if (!sim_is_open) return 0;
+	sim_packets++;
+	if (len >= 3 && p[0] == 0xFF && p[1] == 0xFF && p[2] == 0xFF) return 1;	// boot request
+	sim_busy(sim_erased ? sim_block_us : sim_erase_us);
+	sim_erased = true;
+	return 1;
+}
+
+void teensy_close(void) {
+	sim_is_open = false;
+}
+
+int32_t teensy_open_all(int32_t max) {	// a single simulated board
+	return max > 0 ? teensy_open() : 0;
+}
+
+int32_t teensy_write_to(int32_t index, void *buf, int32_t len, double timeout) {
+	return index == 0 ? teensy_write(buf, len, timeout) : 0;
+}
+
+void teensy_close_all(void) {
+	teensy_close();
+}
+
+int32_t teensy_hard_reboot(void) {
+	return 0;
+}
+
+int32_t teensy_soft_reboot(void) {
+	return 1;
+}
+
+int32_t teensy_location(char *port, size_t port_len, char *serial, size_t serial_len) {
+	snprintf(port, port_len, "sim");
+	snprintf(serial, serial_len, "-");
+	return 1;
+}
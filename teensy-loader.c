@@ -19,13 +19,60 @@
  * along with this program. If not, see http://www.gnu.org/licenses/
 */
 
+#define _GNU_SOURCE	// cpu affinity, strsep
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+
+/*
+*  USDT probes (provider "teensy_loader") for bpftrace/perf. each probe is a
+*  single nop unless a tracer attaches; build with -DNO_USDT or without
+*  <sys/sdt.h> to compile them out entirely.
+*/
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE0(name)			DTRACE_PROBE(teensy_loader, name)
+#define TRACE1(name, a)			DTRACE_PROBE1(teensy_loader, name, a)
+#define TRACE2(name, a, b)		DTRACE_PROBE2(teensy_loader, name, a, b)
+#define TRACE3(name, a, b, c)		DTRACE_PROBE3(teensy_loader, name, a, b, c)
+#endif
+#endif
+#ifndef TRACE0
+#define TRACE0(name)			do {} while (0)
+#define TRACE1(name, a)			do {} while (0)
+#define TRACE2(name, a, b)		do {} while (0)
+#define TRACE3(name, a, b, c)		do {} while (0)
+#endif
+
+/* maximum flash image size supported (without using a bigger chip) */
+#define MAX_MEMORY_SIZE 0x1000000
+#define MAX_BLOCKS	(MAX_MEMORY_SIZE / 128)	// smallest block size is 128 bytes
 
 /* Usage Function */
 void usage(const char *err);
@@ -34,23 +81,141 @@ void usage(const char *err);
 int32_t	teensy_open(void);
 int32_t	teensy_write(void *buf, int32_t len, double timeout);
 void	teensy_close(void);
+int32_t	teensy_location(char *port, size_t port_len, char *serial, size_t serial_len);
+int32_t	teensy_open_all(int32_t max);
+int32_t	teensy_write_to(int32_t index, void *buf, int32_t len, double timeout);
+void	teensy_close_all(void);
+struct hidraw_dev {
+	int	fd;
+	int32_t	busnum, devnum;	// usb address, for teensy_location
+};
+int32_t	hidraw_open_devices(int32_t vid, int32_t pid, struct hidraw_dev *devs, int32_t max);
+int32_t	hidraw_write(int fd, void *buf, int32_t len, double timeout);
+void	hidraw_close(struct hidraw_dev *dev);
+int32_t	usb_device_dir(int32_t busnum, int32_t devnum, char *dir, size_t dir_len);
+int32_t	usb_device_dir_scan(int32_t busnum, int32_t devnum, char *dir, size_t dir_len);
+bool	usb_may_appear(int32_t vid, int32_t pid);
+void	usb_note_absent(int32_t vid, int32_t pid);
 
 /* Teensy Boot Functions */
+#define SYNC_BOOT_MAX	64
 void 	teensy_boot(uint8_t *buf, int32_t write_size);
+void	sync_boot(int32_t count, int32_t write_size);
 int32_t	teensy_hard_reboot(void);
 int32_t	teensy_soft_reboot(void);
 
 /* Intel Hex File Functions */
 int32_t	ihex_read(const char *filename);
+int32_t	ihex_read_stream(FILE *fp, const char *filename);
 int32_t	ihex_bytes_in_range(int32_t begin, int32_t end);
 void	ihex_get_data(int32_t addr, int32_t len, uint8_t *bytes);
 int32_t	ihex_memory_is_blank(int32_t addr, int32_t block_size);
+int32_t	ihex_block_is_dirty(int32_t addr, int32_t block_size);
+int32_t	ihex_write(const char *path, bool drop_blank);
+int32_t	validate_files_parallel(char **paths, int32_t count);
+
+/* Shared Image Functions */
+int32_t	image_load(const char *filename);
+bool	private_shm_dir(char *dir, size_t len, const char *what);
+
+/* Low-Memory Functions */
+int32_t	lowmem_load(const char *path);
+int32_t	lowmem_plan(int32_t *plan);
+void	lowmem_get_data(int32_t addr, int32_t len, uint8_t *bytes);
+void	lowmem_check(void);
+
+/* Realtime Functions */
+void	realtime_prepare(uint8_t *buf, size_t buf_len);
+void	realtime_report(void);
+
+/* Flash Pipeline Functions */
+bool	open_halfkay(void);
+bool	program_blocks(uint8_t *buf);
+
+/* Watch Mode Functions */
+#define WATCH_POLL_US	10000
+void	watch_init(const char *path);
+void	watch_run_done(void);
+uint64_t watch_reload(void);
+int32_t	watch_stopped(void);
+
+/* Device Permission Functions */
+void	perm_denied(const char *node);
+const char *perm_pending(void);
+bool	perm_wait(useconds_t timeout_us);
+void	perm_granted(void);
+
+/* Block Planning Functions */
+int32_t	plan_blocks(const int32_t **plan);
+int32_t	build_block_packet(int32_t addr, uint8_t *buf);
+void	print_flash_estimate(int32_t num);
+int32_t	image_diff(const char *old_file, const char *new_file);
 
 /* Miscellaneous Functions */
 int32_t printf_verbose(const char *format, ...);
 void 	die(const char *str, ...);
+void 	die_cause(const char *cause, const char *str, ...);
 void 	parse_options(int32_t argc, char **argv);
 
+/* Timing Functions */
+enum timing_phase {
+	PHASE_PARSE,	// ihex_read
+	PHASE_OPEN,	// open_usb_device (HalfKay enumeration)
+	PHASE_REBOOT,	// hard/soft reboot requests
+	PHASE_WAIT,	// sleeping in the wait loop
+	PHASE_ERASE,	// first block write (chip erase)
+	PHASE_WRITE,	// remaining block writes
+	PHASE_BOOT,	// teensy_boot
+	PHASE_COUNT
+};
+static const char *timing_phase_names[PHASE_COUNT] = {
+	"parse", "open", "reboot", "wait", "erase", "write", "boot"
+};
+uint64_t monotonic_ns(void);
+uint64_t timing_begin(enum timing_phase phase);
+uint64_t timing_add(enum timing_phase phase, uint64_t start_ns);
+void	timings_print_json(void);
+
+/* Event Stream Functions */
+void	events_open(const char *spec);
+void	event_emit(const char *name, const char *fields, ...);
+void	event_emit_at(uint64_t t_ns, const char *name, const char *fields, ...);
+void	event_block(uint64_t t_ns, int32_t n, int32_t total, int32_t addr, uint64_t latency_ns);
+void	events_flush(void);
+void	events_finish(void);
+
+/* Log Ring Functions */
+void	log_ring_start(void);
+void	log_ring_stop(void);
+void	log_block(int32_t n, int32_t total, int32_t addr, uint64_t latency_ns);
+
+/* Health Histogram Functions */
+#define HIST_SUB_BITS	3				// 8 linear sub-buckets per power of two
+#define HIST_BUCKETS	((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+enum health_metric { HEALTH_BLOCK, HEALTH_ERASE, HEALTH_REBOOT, HEALTH_COUNT };
+struct histogram {
+	uint64_t count;
+	uint32_t buckets[HIST_BUCKETS];
+};
+void	hist_record(struct histogram *h, uint64_t value_us);
+uint64_t hist_percentile(const struct histogram *h, double p);
+void	health_update(void);
+void	health_report(void);
+
+/* Metrics Exporter Functions */
+void	metrics_write(void);
+
+/* Status Page Functions */
+void	status_open(void);
+void	status_phase(enum timing_phase phase);
+void	status_block(int32_t done, int32_t total, uint64_t latency_ns);
+int32_t	status_watch(int32_t interval_ms);
+
+/* Flash Farm Functions */
+#define FARM_MAX_STATIONS	32
+int32_t	farm_worker(const char *host, int32_t port);
+int32_t	farm_coordinator(void);
+
 /* User CLI Options */
 bool wait_for_device_to_appear,
      teensy_hard_reboot_device,
@@ -59,20 +224,89 @@ bool wait_for_device_to_appear,
      boot_only			= false;
 bool reboot_after_programming	= true;
 int32_t code_size = 0, block_size = 0;
+int32_t erase_ms = 0, block_us = 0;		// per-mcu timing model, see MCUs[]
+bool dry_run = false;
+bool realtime = false;
+bool shared_image = false;
+bool hidraw_transport = false;			// --transport=hidraw: HalfKay through /dev/hidrawN
+bool low_memory = false;			// --low-memory: index the hex file, never build the image
+const char *diff_base = NULL;			// --diff: image compared against filename
+const char *normalize_path = NULL;		// --normalize: canonical hex output
+bool drop_blank = false;
+int32_t sync_boot_count = 0;			// --sync-boot: boot this many boards at once
+int32_t worker_port = 0;			// --worker: serve flash jobs on this tcp port
+const char *worker_host = "127.0.0.1";		// --listen: address the worker binds
+bool coordinator = false;
+const char *stations[FARM_MAX_STATIONS];	// --station: host:port or "local"
+int32_t station_count = 0;
+bool status_page = false;			// --status: publish progress in shared memory
+int32_t status_watch_ms = -1;			// --status-watch: read it instead
 const char *filename = NULL;
+char **input_files = NULL;			// every positional argument, for --validate
+int32_t input_count = 0;
+bool validate = false;
+bool watch = false;				// --watch: reflash whenever filename is rewritten
+volatile sig_atomic_t watch_stop = 0;		// --watch: the SIGINT or SIGTERM that ends it
+useconds_t wait_poll_us = 250000;		// wait loop interval while HalfKay is absent
+const char *mcu_name = NULL;
+bool timings_json = false;
+bool health_report_only = false;
+const char *health_db = NULL;			// NULL: default path, "off": disabled
+const char *metrics_path = NULL;
+struct histogram run_hist[HEALTH_COUNT];	// this run, merged into the health db on exit
+
+/* Timing Counters */
+struct {
+	uint64_t start_ns;
+	uint64_t phase_ns[PHASE_COUNT];
+	int32_t	 phase_calls[PHASE_COUNT];
+	int32_t	 blocks_written;
+	int64_t	 bytes_written;
+	uint64_t block_max_ns;
+	int32_t	 write_retries;
+	int32_t	 open_attempts;
+	uint64_t open_ns;		// start of the teensy_open that found HalfKay
+	uint64_t open_to_transfer_ns;	// from there to the first block transfer
+	uint64_t permission_wait_ns;	// udev applying the HalfKay node's permissions
+	int32_t	 gap_count;		// host time between consecutive block transfers
+	double	 gap_mean_ns, gap_m2;	// (welford running mean and sum of squares)
+	uint64_t gap_max_ns;
+	const char *reboot_method;	// "hard", "soft" or NULL
+	bool	 reboot_ok;		// HalfKay appeared after the reboot request
+	const char *error_cause;	// set by die_cause() and watch_stopped()
+	bool	 success;
+	bool	 idle;			// --watch between runs, nothing to report
+} timings;
 
 
 /**********************/
 /*    Main Program    */
 /**********************/
 
+#ifndef TEENSY_LOADER_NO_MAIN	// defined by the benchmarks, which include this file
 int32_t main(int32_t argc, char **argv) {
 	uint8_t buf[2048];
-	int32_t num, addr, r, write_size;
-	int32_t first_block = 1;
-	bool waited = false;
+	int32_t num, write_size;
+	bool waited;
+	uint64_t t, change_ns = 0;
 
+	timings.start_ns = monotonic_ns();
 	parse_options(argc, argv);
+	if (health_report_only) {
+		health_report();
+		return 0;
+	}
+	if (status_watch_ms >= 0) return status_watch(status_watch_ms);
+	if (validate) {
+		if (!input_count) usage("--validate needs at least one file");
+		return validate_files_parallel(input_files, input_count) ? 1 : 0;
+	}
+	if (worker_port) return farm_worker(worker_host, worker_port);
+	if (coordinator) return farm_coordinator();
+	if (timings_json) atexit(timings_print_json);	// also report runs that die()
+	if (metrics_path) atexit(metrics_write);
+	atexit(events_finish);
+	if (status_page) status_open();
 	
 	if (!filename && !boot_only) {
 		usage("filename must be specified");
@@ -80,6 +314,9 @@ int32_t main(int32_t argc, char **argv) {
 	if (!code_size) {
 		usage("mcu type must be specified");
 	}
+	if (low_memory && (normalize_path || shared_image)) {
+		usage("--low-memory cannot be combined with --normalize or --shared-image");
+	}
 	printf_verbose("teensy-loader cli\n");
 
 	if (block_size == 512 || block_size == 1024) {
@@ -88,108 +325,638 @@ int32_t main(int32_t argc, char **argv) {
 		write_size = block_size + 2;
 	};
 
+	if (diff_base) {
+		if (image_diff(diff_base, filename) < 0) die_cause("parse", "error reading intel hex files");
+		timings.success = true;
+		return 0;
+	}
+
+	if (watch) watch_init(filename);	// before the first parse, so no rewrite is missed
+
 	if (!boot_only) {
-		num = ihex_read(filename);	// read the intel hex file (done first so errors arise before usb)
-		if (num < 0) die("error reading intel hex file \"%s\"", filename);
+		t = timing_begin(PHASE_PARSE);
+		num = image_load(filename);	// read the intel hex file (done first so errors arise before usb)
+		timing_add(PHASE_PARSE, t);
+		if (num < 0) die_cause("parse", "error reading intel hex file \"%s\"", filename);
 		printf_verbose("Read \"%s\": %d bytes, %.1f%% usage\n",
 			filename, num, (double) num / (double) code_size * 100.0);
+		if (normalize_path) {
+			if (ihex_write(normalize_path, drop_blank) < 0)
+				die("unable to write \"%s\": %s", normalize_path, strerror(errno));
+			timings.success = true;
+			return 0;
+		}
+		if (dry_run) {
+			print_flash_estimate(num);
+			timings.success = true;
+			return 0;
+		}
+	}
+
+	if (realtime) realtime_prepare(buf, sizeof(buf));
+
+	if (sync_boot_count) {
+		sync_boot(sync_boot_count, write_size);
+		timings.success = true;
+		return 0;
+	}
+
+	while (1) {
+		/* open the usb device */
+		waited = open_halfkay();
+		if (watch_stop) return watch_stopped();
+
+		if (boot_only) {
+			t = timing_begin(PHASE_BOOT);
+			teensy_boot(buf, write_size);
+			timing_add(PHASE_BOOT, t);
+			event_emit("boot", "");
+			teensy_close();
+			timings.success = true;
+			return 0;
+		}
+		if (waited && !watch) {	// if we waited for the device read the hex file again (in case it changed while waiting)
+			t = timing_begin(PHASE_PARSE);	// (--watch reflashes on the next change instead)
+			num = image_load(filename);
+			timing_add(PHASE_PARSE, t);
+			if (num < 0) die_cause("parse", "error reading intel hex file \"%s\"", filename);
+			printf_verbose("read \"%s\": %d bytes, %.1f%% usage\n",
+			 	filename, num, (double) num / (double) code_size * 100.0);
+		}
+
+		/* write data to the teensy */
+		if (!program_blocks(buf)) {
+			teensy_close();
+			return watch_stopped();
+		}
+		health_update();	// before boot, while the HalfKay device is still enumerated
+
+		// reboot to the user's new code
+		if (reboot_after_programming) {
+			t = timing_begin(PHASE_BOOT);
+			teensy_boot(buf, write_size);
+			timing_add(PHASE_BOOT, t);
+			event_emit("boot", "");
+		}
+
+		teensy_close();
+		timings.success = true;
+		if (!watch) return 0;
+		if (change_ns) printf("reflashed %.0f ms after \"%s\" was rewritten\n", (monotonic_ns() - change_ns) / 1e6, filename);
+
+		watch_run_done();
+		change_ns = watch_reload();
+		if (watch_stop) return watch_stopped();
+		teensy_soft_reboot_device = reboot_after_programming;	// with -n the board is still in HalfKay
+		wait_for_device_to_appear = true;
+		wait_poll_us = WATCH_POLL_US;
 	}
+}
+#endif
+
+
+/************************/
+/*    Flash Pipeline    */
+/************************/
+
+/* find and open HalfKay, rebooting and waiting as the options allow; returns true if it had to wait */
+bool open_halfkay(void) {
+	uint64_t t, reboot_ns = 0;
+	bool waited = false;
+	int32_t r;
 
-	/* open the usb device */
 	while (1) {
-		if (teensy_open()) break;
+		t = timing_begin(PHASE_OPEN);
+		r = teensy_open();
+		timing_add(PHASE_OPEN, t);
+		timings.open_attempts++;
+		if (r) {
+			timings.open_ns = t;
+			perm_granted();
+			break;
+		}
 		if (teensy_hard_reboot_device) {
-			if (!teensy_hard_reboot()) die("unable to find rebootor\n");
+			t = timing_begin(PHASE_REBOOT);
+			r = teensy_hard_reboot();
+			timing_add(PHASE_REBOOT, t);
+			timings.reboot_method = "hard";
+			if (!r) die_cause("no_rebootor", "unable to find rebootor\n");
+			reboot_ns = monotonic_ns();
 			printf_verbose("hard reboot performed\n");
+			event_emit("reboot", ",\"method\":\"hard\"");
 			teensy_hard_reboot_device = false;	// only hard reboot once
 			wait_for_device_to_appear = true;
 		}
 		if (teensy_soft_reboot_device) {
-			if (teensy_soft_reboot()) {
+			t = timing_begin(PHASE_REBOOT);
+			r = teensy_soft_reboot();
+			timing_add(PHASE_REBOOT, t);
+			timings.reboot_method = "soft";
+			if (r) {
+				reboot_ns = monotonic_ns();
 				printf_verbose("soft reboot performed\n");
+				event_emit("reboot", ",\"method\":\"soft\"");
 			}
 			teensy_soft_reboot_device = false;
 			wait_for_device_to_appear = true;
 		}
-		if (!wait_for_device_to_appear) die("unable to open device (try -w option)\n");
+		if (!wait_for_device_to_appear) {
+			if (perm_pending()) die_cause("permission", "no permission to open %s (check the udev rules)\n", perm_pending());
+			die_cause("no_device", "unable to open device (try -w option)\n");
+		}
 		if (!waited) {
+			event_emit("waiting", "");
 			printf_verbose("waiting for teensy device...\n");
 			printf_verbose("\t(try pressing the reset button)\n");
 			waited = true;
 		}
-		usleep(250000);	// sleep 0.25s (250000ms)
+		t = timing_begin(PHASE_WAIT);
+		if (!perm_wait(wait_poll_us)) usleep(wait_poll_us);	// 0.25s unless --watch is waiting on a soft reboot
+		timing_add(PHASE_WAIT, t);
+		if (watch_stop) return waited;
 	}
 	printf_verbose("found HalfKay bootloader\n");
-
-	if (boot_only) {
-		teensy_boot(buf, write_size);
-		teensy_close();
-		return 0;
-	}
-	if (waited) {	// if we waited for the device read the hex file again (in case it changed while waiting)
-		num = ihex_read(filename);
-		if (num < 0) die("error reading intel hex file \"%s\"", filename);
-		printf_verbose("read \"%s\": %d bytes, %.1f%% usage\n",
-		 	filename, num, (double) num / (double) code_size * 100.0);
+	if (reboot_ns) {
+		hist_record(&run_hist[HEALTH_REBOOT], (monotonic_ns() - reboot_ns) / 1000);
+		timings.reboot_ok = true;
 	}
+	event_emit("device_found", ",\"attempts\":%d", timings.open_attempts);
+	return waited;
+}
+
+/* write every planned block, the first with the long erase timeout; false if --watch was stopped part way */
+bool program_blocks(uint8_t *buf) {
+	int32_t addr, r, write_size;
+	int32_t first_block = 1, blocks_done = 0, blocks_total;
+	const int32_t *plan;
+	uint64_t t, start, last_end = 0;
+	double gap, delta;
+
+	blocks_total = plan_blocks(&plan);
+	if (low_memory) lowmem_check();	// still the file that was indexed, before the erase
 
-	/* write data to the teensy */
 	printf_verbose("programming...");
-	fflush(stdout);
-	for (addr = 0; addr < code_size; addr += block_size) {
-		/* only write first unused block to erase the chip */
-		if (!first_block && !ihex_bytes_in_range(addr, addr + block_size - 1)) continue;
-		if (!first_block && ihex_memory_is_blank(addr, block_size)) continue;
-		
-		printf_verbose("- addr: %d\n", addr);
-		if (block_size <= 256 && code_size < 0x10000) {
-			buf[0] = addr & 255;
-			buf[1] = (addr >> 8) & 255;
-			ihex_get_data(addr, block_size, buf + 2);
-			write_size = block_size + 2;
-		} else if (block_size == 256) {
-			buf[0] = (addr >> 8) & 255;
-			buf[1] = (addr >> 16) & 255;
-			ihex_get_data(addr, block_size, buf + 2);
-			write_size = block_size + 2;
-		} else if (block_size == 512 || block_size == 1024) {
-			buf[0] = addr & 255;
-			buf[1] = (addr >> 8) & 255;
-			buf[2] = (addr >> 16) & 255;
-			memset(buf + 3, 0, 61);
-			ihex_get_data(addr, block_size, buf + 64);
-			write_size = block_size + 64;
-		} else {
-			die("unknown code/block size\n");
+	event_emit("erase_started", ",\"blocks\":%d", blocks_total);
+	log_ring_start();	// no formatted output from here until log_ring_stop()
+	status_phase(PHASE_ERASE);
+	for (int32_t b = 0; b < blocks_total; b++) {
+		if (watch_stop) {
+			log_ring_stop();
+			printf_verbose("\n");
+			return false;
+		}
+		addr = plan[b];
+		TRACE2(block_planned, addr, blocks_done + 1);
+		write_size = build_block_packet(addr, buf);
+		TRACE2(transfer_start, addr, write_size);
+		start = monotonic_ns();
+		if (first_block) timings.open_to_transfer_ns = start - timings.open_ns;
+		if (last_end) {
+			gap = (double)(start - last_end);
+			delta = gap - timings.gap_mean_ns;
+			timings.gap_mean_ns += delta / ++timings.gap_count;
+			timings.gap_m2 += delta * (gap - timings.gap_mean_ns);
+			if (start - last_end > timings.gap_max_ns) timings.gap_max_ns = start - last_end;
 		}
 		r = teensy_write(buf, write_size, first_block ? 5.0 : 0.5);
-		if (!r) die("error writing to teensy\n");
+		t = timing_add(first_block ? PHASE_ERASE : PHASE_WRITE, start);
+		last_end = start + t;
+		TRACE3(transfer_end, addr, r, t);
+		if (!r) die_cause(first_block ? "erase_timeout" : "write_timeout", "error writing to teensy\n");
+		if (t > timings.block_max_ns) timings.block_max_ns = t;
+		hist_record(&run_hist[first_block ? HEALTH_ERASE : HEALTH_BLOCK], t / 1000);
+		timings.blocks_written++;
+		timings.bytes_written += block_size;
+		log_block(++blocks_done, blocks_total, addr, t);
+		status_block(blocks_done, blocks_total, t);
 		first_block = 0;
 	}
+	log_ring_stop();
+	if (low_memory) lowmem_check();	// and no block came from a newer one, before booting
 	printf_verbose("\n");
+	if (realtime) realtime_report();
+	return true;
+}
 
-	// reboot to the user's new code
-	if (reboot_after_programming) 
-		teensy_boot(buf, write_size);
-	
-	teensy_close();
+
+/********************************/
+/*    HalfKay Block Planning    */
+/********************************/
+
+/*
+*  the first block is always written (it makes HalfKay erase the chip);
+*  after that only blocks holding non-blank data are sent.
+*/
+static int32_t block_plan[MAX_BLOCKS];
+static const int32_t *shared_plan = NULL;	// plan published with a shared image
+static int32_t shared_plan_count;
+
+int32_t plan_blocks(const int32_t **plan) {
+	int32_t n = 0;
+
+	if (shared_plan) {
+		*plan = shared_plan;
+		return shared_plan_count;
+	}
+	if (low_memory) {
+		*plan = block_plan;
+		return lowmem_plan(block_plan);
+	}
+	for (int32_t addr = 0; addr < code_size; addr += block_size) {
+		if (n && !ihex_block_is_dirty(addr, block_size)) continue;
+		block_plan[n++] = addr;
+	}
+	*plan = block_plan;
+	return n;
+}
+
+/* fill buf with the HalfKay packet for the block at addr, returns the packet size */
+int32_t build_block_packet(int32_t addr, uint8_t *buf) {
+	if (block_size <= 256 && code_size < 0x10000) {
+		buf[0] = addr & 255;
+		buf[1] = (addr >> 8) & 255;
+		ihex_get_data(addr, block_size, buf + 2);
+		return block_size + 2;
+	} else if (block_size == 256) {
+		buf[0] = (addr >> 8) & 255;
+		buf[1] = (addr >> 16) & 255;
+		ihex_get_data(addr, block_size, buf + 2);
+		return block_size + 2;
+	} else if (block_size == 512 || block_size == 1024) {
+		buf[0] = addr & 255;
+		buf[1] = (addr >> 8) & 255;
+		buf[2] = (addr >> 16) & 255;
+		memset(buf + 3, 0, 61);
+		ihex_get_data(addr, block_size, buf + 64);
+		return block_size + 64;
+	}
+	die_cause("internal", "unknown code/block size\n");
+	return 0;
+}
+
+/* print the block plan and predicted flash time (--dry-run) */
+void print_flash_estimate(int32_t num) {
+	const int32_t *plan;
+	int32_t blocks, packet_size;
+	double erase_s, transfer_s;
+	uint8_t buf[2048];
+
+	blocks = plan_blocks(&plan);
+	packet_size = build_block_packet(0, buf);
+	erase_s = erase_ms / 1000.0;
+	transfer_s = (blocks - 1) * (block_us / 1e6);
+	printf("mcu: %s\n", mcu_name);
+	printf("file: %s\n", filename);
+	printf("data_bytes: %d\n", num);
+	printf("usage_percent: %.1f\n", (double) num / (double) code_size * 100.0);
+	printf("block_size: %d\n", block_size);
+	printf("blocks: %d\n", blocks);
+	printf("bytes_programmed: %lld\n", (long long) blocks * block_size);
+	printf("bytes_transferred: %lld\n", (long long) blocks * packet_size);
+	printf("last_address: %d\n", plan[blocks - 1] + block_size - 1);
+	printf("estimated_erase_s: %.3f\n", erase_s);
+	printf("estimated_transfer_s: %.3f\n", transfer_s);
+	printf("estimated_total_s: %.3f\n", erase_s + transfer_s);
+}
+
+/*
+*  compare the programmed view (unset bytes read as 0xFF) of two images block
+*  by block. each image is flattened once with ihex_get_data and the blocks
+*  are compared with memcmp, so the cost is a few passes over code_size bytes.
+*  HalfKay erases the whole chip, so flashing new_file still programs all of
+*  its blocks; the changed blocks say what actually differs on the device.
+*  returns the number of changed blocks, or -1 if either file fails to load.
+*/
+int32_t image_diff(const char *old_file, const char *new_file) {
+	uint8_t *old_img, *new_img;
+	const int32_t *plan;
+	int32_t old_blocks, new_blocks, changed = 0, ranges = 0, range_start = -1;
+	int64_t changed_bytes = 0;
+	uint64_t t, load_ns;
+
+	t = monotonic_ns();
+	old_img = malloc(code_size);
+	new_img = malloc(code_size);
+	if (!old_img || !new_img) die("out of memory");
+	if (image_load(old_file) < 0) {
+		free(old_img);
+		free(new_img);
+		return -1;
+	}
+	ihex_get_data(0, code_size, old_img);
+	old_blocks = plan_blocks(&plan);
+	if (image_load(new_file) < 0) {
+		free(old_img);
+		free(new_img);
+		return -1;
+	}
+	ihex_get_data(0, code_size, new_img);
+	new_blocks = plan_blocks(&plan);
+	load_ns = timing_add(PHASE_PARSE, t);
+
+	t = monotonic_ns();
+	printf("mcu: %s\n", mcu_name);
+	printf("old: %s\n", old_file);
+	printf("new: %s\n", new_file);
+	printf("block_size: %d\n", block_size);
+	for (int32_t addr = 0; addr <= code_size; addr += block_size) {
+		if (addr < code_size && memcmp(old_img + addr, new_img + addr, block_size)) {
+			for (int32_t i = addr; i < addr + block_size; i++)
+				changed_bytes += old_img[i] != new_img[i];
+			if (range_start < 0) range_start = addr;
+			changed++;
+		} else if (range_start >= 0) {
+			printf("changed: 0x%06x-0x%06x (%d blocks)\n",
+				range_start, addr - 1, (addr - range_start) / block_size);
+			range_start = -1;
+			ranges++;
+		}
+	}
+	printf("changed_ranges: %d\n", ranges);
+	printf("changed_blocks: %d\n", changed);
+	printf("changed_bytes: %lld\n", (long long) changed_bytes);
+	printf("old_blocks: %d\n", old_blocks);
+	printf("new_blocks: %d\n", new_blocks);
+	printf("bytes_programmed: %lld\n", (long long) new_blocks * block_size);
+	printf("estimated_total_s: %.3f\n", erase_ms / 1000.0 + (new_blocks - 1) * (block_us / 1e6));
+	printf_verbose("loaded in %.3f ms, compared in %.3f ms\n", load_ns / 1e6, (monotonic_ns() - t) / 1e6);
+	free(old_img);
+	free(new_img);
+	return changed;
+}
+
+
+/***************************/
+/*    USB Device Lookup    */
+/***************************/
+
+/*
+*  sysfs lookups shared by the transports, health keying and the wait loop.
+*  each one goes straight to its answer through an index the kernel keeps
+*  (the usb char device links in /sys/dev/char, the vid:pid in hid device
+*  names) rather than reading attributes of every device. libusb cannot be
+*  pointed at such an index: every enumeration reads all devices. so the
+*  libusb wait loop keeps an inotify watch on the usbfs directories, where
+*  devtmpfs adds a node for each new device, and skips enumerating until a
+*  node appears after an enumeration that found no match. polling then does
+*  not get slower as a host collects usb devices; the soft reboot still
+*  enumerates once per reboot. the watch only ever skips work: without it,
+*  after a lost event (IN_Q_OVERFLOW) and at least every USB_FULL_SCAN_NS
+*  the loop enumerates as it used to. the roots can be moved onto a synthetic tree,
+*  which is how bench/bench-enum measures these lookups.
+*/
+#define USB_DEVICE_MAJOR	189
+
+const char *sysfs_root = "/sys";
+const char *dev_root = "/dev";
+
+static int32_t read_sysfs_attr(const char *dir, const char *attr, char *out, size_t out_len) {
+	char path[512];
+	FILE *fp;
+	size_t n;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fp = fopen(path, "r");
+	if (!fp) return 0;
+	n = fread(out, 1, out_len - 1, fp);
+	fclose(fp);
+	while (n && (out[n - 1] == '\n' || out[n - 1] == ' ')) n--;
+	out[n] = '\0';
+	return n > 0;
+}
+
+/* sysfs directory of a usb device by scanning every device's busnum and devnum */
+int32_t usb_device_dir_scan(int32_t busnum, int32_t devnum, char *dir, size_t dir_len) {
+	char root[512], val[32];
+	struct dirent *de;
+	int32_t found = 0;
+	DIR *d;
+
+	snprintf(root, sizeof(root), "%s/bus/usb/devices", sysfs_root);
+	if (!(d = opendir(root))) return 0;
+	while (!found && (de = readdir(d))) {
+		if (de->d_name[0] == '.' || strchr(de->d_name, ':')) continue;	// skip interfaces
+		snprintf(dir, dir_len, "%s/%s", root, de->d_name);
+		if (!read_sysfs_attr(dir, "busnum", val, sizeof(val)) || atoi(val) != busnum) continue;
+		if (!read_sysfs_attr(dir, "devnum", val, sizeof(val)) || atoi(val) != devnum) continue;
+		found = 1;
+	}
+	closedir(d);
+	return found;
+}
+
+/* sysfs directory of a usb device, through its char device link if the kernel has one */
+int32_t usb_device_dir(int32_t busnum, int32_t devnum, char *dir, size_t dir_len) {
+	char link[512], real[PATH_MAX];
+
+	if (busnum < 1 || devnum < 1) return 0;
+	snprintf(link, sizeof(link), "%s/dev/char/%d:%d", sysfs_root,
+		USB_DEVICE_MAJOR, (busnum - 1) * 128 + devnum - 1);
+	if (realpath(link, real) && strlen(real) < dir_len) {
+		strcpy(dir, real);
+		return 1;
+	}
+	return usb_device_dir_scan(busnum, devnum, dir, dir_len);
+}
+
+#define USB_ABSENT_SLOTS	4	// HalfKay, the rebootor and room to spare
+#define USB_FULL_SCAN_NS	1000000000ull	// enumerate at least this often regardless
+
+static int	 usb_watch_fd = -2;	// -2: not watching yet, -1: cannot watch
+static int	 usb_watch_top;
+static uint32_t	 usb_generation = 0;	// bumped for every usb device node that appears
+static struct {
+	int32_t	 vid, pid;
+	uint32_t generation;	// an enumeration at this generation found none
+	uint64_t noted_ns;	// when it ran
+} usb_absent[USB_ABSENT_SLOTS];
+
+/* watch <dev_root>/bus/usb for new buses and every bus directory for new devices */
+static void usb_watch_open(void) {
+	char root[512], path[1024];
+	struct dirent *de;
+	DIR *d;
+
+	usb_generation++;	// forget what was absent before the watch existed
+	snprintf(root, sizeof(root), "%s/bus/usb", dev_root);
+	if ((usb_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return;
+	if ((usb_watch_top = inotify_add_watch(usb_watch_fd, root, IN_CREATE | IN_DELETE_SELF)) < 0 ||
+	    !(d = opendir(root))) {
+		close(usb_watch_fd);
+		usb_watch_fd = -1;
+		return;
+	}
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+		if (inotify_add_watch(usb_watch_fd, path, IN_CREATE) < 0) {
+			close(usb_watch_fd);
+			usb_watch_fd = -1;
+			break;
+		}
+	}
+	closedir(d);
+}
+
+/* false while no usb device appeared since an enumeration found no vid:pid, for up to USB_FULL_SCAN_NS */
+bool usb_may_appear(int32_t vid, int32_t pid) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n = 0;
+
+	if (usb_watch_fd == -2) usb_watch_open();
+	while (usb_watch_fd >= 0 && (n = read(usb_watch_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			usb_generation++;	// including IN_Q_OVERFLOW: events were lost, so enumerate
+			if (ev->wd == usb_watch_top && (ev->mask & (IN_ISDIR | IN_DELETE_SELF))) {
+				close(usb_watch_fd);	// a bus added or the tree gone: watch afresh
+				usb_watch_fd = -2;
+				return true;
+			}
+		}
+	}
+	if (usb_watch_fd >= 0 && n < 0 && errno != EAGAIN && errno != EINTR) {
+		close(usb_watch_fd);	// the watch broke, enumerate every time from now on
+		usb_watch_fd = -1;
+	}
+	if (usb_watch_fd < 0) return true;
+	for (int32_t i = 0; i < USB_ABSENT_SLOTS; i++) {
+		if (usb_absent[i].vid == vid && usb_absent[i].pid == pid && usb_absent[i].generation == usb_generation)
+			return monotonic_ns() - usb_absent[i].noted_ns >= USB_FULL_SCAN_NS;
+	}
+	return true;
+}
+
+/* an enumeration that started after usb_may_appear found no vid:pid */
+void usb_note_absent(int32_t vid, int32_t pid) {
+	int32_t i;
+
+	if (usb_watch_fd < 0) return;
+	for (i = 0; i < USB_ABSENT_SLOTS - 1; i++) {
+		if ((usb_absent[i].vid == vid && usb_absent[i].pid == pid) || !usb_absent[i].vid) break;
+	}
+	usb_absent[i].vid = vid;
+	usb_absent[i].pid = pid;
+	usb_absent[i].generation = usb_generation;
+	usb_absent[i].noted_ns = monotonic_ns();
+}
+
+
+/*****************************/
+/*    USB Access (hidraw)    */
+/*****************************/
+
+/*
+*  --transport=hidraw talks to HalfKay through the /dev/hidrawN node usbhid
+*  already created for it: no usbfs scan, no kernel driver detach and no
+*  claim, and a udev rule on the hidraw node (00-teensy.rules has one) is all
+*  an unprivileged user needs. HalfKay declares one output report without an
+*  id, so each packet is written with a leading 0 report id and usbhid sends
+*  it as the same SET_REPORT request the libusb path issues by hand. hid
+*  devices are named bus:vid:pid.id, so matching needs no attribute reads.
+*/
+
+/* usb bus and device number of the device a hid device belongs to */
+static void hidraw_usb_address(const char *hid_dir, struct hidraw_dev *dev) {
+	char real[PATH_MAX], val[32], *p;
+
+	dev->busnum = dev->devnum = -1;
+	if (!realpath(hid_dir, real)) return;
+	for (int32_t i = 0; i < 2; i++) {	// hid device -> usb interface -> usb device
+		if ((p = strrchr(real, '/'))) *p = '\0';
+	}
+	if (read_sysfs_attr(real, "busnum", val, sizeof(val))) dev->busnum = atoi(val);
+	if (read_sysfs_attr(real, "devnum", val, sizeof(val))) dev->devnum = atoi(val);
+}
+
+/* name of the hidraw node under a hid device, false if it has none (yet) */
+static bool hidraw_node(const char *hid_dir, char *name, size_t name_len) {
+	char path[1024];
+	struct dirent *de;
+	bool found = false;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/hidraw", hid_dir);
+	if (!(d = opendir(path))) return false;
+	while (!found && (de = readdir(d))) {
+		if (strncmp(de->d_name, "hidraw", 6)) continue;
+		snprintf(name, name_len, "%s", de->d_name);
+		found = true;
+	}
+	closedir(d);
+	return found;
+}
+
+/* open every hidraw node of a matching usb hid device, up to max; returns how many were opened */
+int32_t hidraw_open_devices(int32_t vid, int32_t pid, struct hidraw_dev *devs, int32_t max) {
+	char root[512], dir[768], path[512], name[256], want[32];
+	struct dirent *de;
+	int32_t n = 0;
+	DIR *d;
+
+	snprintf(root, sizeof(root), "%s/bus/hid/devices", sysfs_root);
+	if (!(d = opendir(root))) return 0;
+	snprintf(want, sizeof(want), "0003:%04X:%04X.", vid, pid);
+	while (n < max && (de = readdir(d))) {
+		if (strncmp(de->d_name, want, strlen(want))) continue;
+		snprintf(dir, sizeof(dir), "%s/%s", root, de->d_name);
+		if (!hidraw_node(dir, name, sizeof(name))) continue;
+		snprintf(path, sizeof(path), "%s/%s", dev_root, name);
+		if ((devs[n].fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+			if (errno == EACCES) perm_denied(path);
+			else printf_verbose("found %s but unable to open: %s\n", path, strerror(errno));
+			continue;
+		}
+		hidraw_usb_address(dir, &devs[n]);
+		TRACE2(device_open, vid, pid);
+		n++;
+	}
+	closedir(d);
+	return n;
+}
+
+int32_t hidraw_write(int fd, void *buf, int32_t len, double timeout) {
+	uint8_t report[1 + 2048];
+
+	if (fd < 0 || len > 2048) return 0;
+	report[0] = 0;	// report id
+	memcpy(report + 1, buf, len);
+	while (timeout > 0) {
+		if (write(fd, report, len + 1) == len + 1) return 1;
+		__atomic_add_fetch(&timings.write_retries, 1, __ATOMIC_RELAXED);
+		TRACE2(retry, -errno, (int32_t)(timeout * 1000.0));
+		usleep(10000);
+		timeout -= 0.01;
+	}
 	return 0;
 }
 
+void hidraw_close(struct hidraw_dev *dev) {
+	if (dev->fd < 0) return;
+	close(dev->fd);
+	TRACE0(device_close);
+	dev->fd = -1;
+}
+
 
 /*****************************/
 /*    USB Access (libusb)    */
 /*****************************/
 
+#if !defined(USE_SIMULATOR)	// libusb is the default backend
+
 #include <usb.h>
 
-usb_dev_handle *open_usb_device(int32_t vid, int32_t pid) {
+/* open every matching device, up to max; returns how many were opened */
+int32_t open_usb_devices(int32_t vid, int32_t pid, usb_dev_handle **handles, int32_t max) {
 	struct usb_bus *bus;
 	struct usb_device *dev;
 	usb_dev_handle *h;
-	char buf[128];
-	int32_t r;
+	char buf[128], node[512];
+	int32_t r, n = 0, matched = 0;
 
+	if (!usb_may_appear(vid, pid)) return 0;	// nothing was plugged in since the last miss
 	usb_init();
 	usb_find_busses();
 	usb_find_devices();
@@ -198,6 +965,12 @@ usb_dev_handle *open_usb_device(int32_t vid, int32_t pid) {
 		for (dev = bus->devices; dev; dev = dev->next) {
 			if (dev->descriptor.idVendor != vid) continue;
 			if (dev->descriptor.idProduct != pid) continue;
+			matched++;
+			snprintf(node, sizeof(node), "%s/bus/usb/%.16s/%.16s", dev_root, bus->dirname, dev->filename);
+			if (access(node, R_OK | W_OK) && errno == EACCES) {	// usb_open would fall back to read-only
+				perm_denied(node);
+				continue;
+			}
 			h = usb_open(dev);
 			if (!h) {
 				printf_verbose("found device but unable to open\n");
@@ -214,39 +987,113 @@ usb_dev_handle *open_usb_device(int32_t vid, int32_t pid) {
 				}
 			}
 			#endif
-			return h;
+			TRACE2(device_open, vid, pid);
+			handles[n++] = h;
+			if (n == max) return n;
 		}
 	}
-	return NULL;
+	if (!matched) usb_note_absent(vid, pid);
+	return n;
+}
+
+usb_dev_handle *open_usb_device(int32_t vid, int32_t pid) {
+	usb_dev_handle *h;
+
+	return open_usb_devices(vid, pid, &h, 1) ? h : NULL;
 }
 
 static usb_dev_handle *libusb_teensy_handle = NULL;
+static struct hidraw_dev hidraw_teensy = { -1, -1, -1 };
+
+static int32_t teensy_busnum = -1, teensy_devnum = -1;
 
 int32_t teensy_open(void) {
+	struct usb_device *dev;
+
 	teensy_close();
+	if (hidraw_transport) {
+		if (!hidraw_open_devices(0x16C0, 0x0478, &hidraw_teensy, 1)) return 0;
+		teensy_busnum = hidraw_teensy.busnum;
+		teensy_devnum = hidraw_teensy.devnum;
+		return 1;
+	}
 	libusb_teensy_handle = open_usb_device(0x16C0, 0x0478);
-	if (libusb_teensy_handle) return 1;
-	return 0;
+	if (!libusb_teensy_handle) return 0;
+	dev = usb_device(libusb_teensy_handle);
+	teensy_busnum = atoi(dev->bus->dirname);
+	teensy_devnum = atoi(dev->filename);
+	return 1;
 }
 
-int32_t teensy_write(void *buf, int32_t len, double timeout) {
+/* resolve the open HalfKay device's stable port path (e.g. "1-1.2") and serial via sysfs */
+int32_t teensy_location(char *port, size_t port_len, char *serial, size_t serial_len) {
+	char dir[PATH_MAX];
+
+	if (!usb_device_dir(teensy_busnum, teensy_devnum, dir, sizeof(dir))) return 0;
+	snprintf(port, port_len, "%s", strrchr(dir, '/') + 1);
+	if (!read_sysfs_attr(dir, "serial", serial, serial_len)) snprintf(serial, serial_len, "-");
+	return 1;
+}
+
+static int32_t libusb_write(usb_dev_handle *h, void *buf, int32_t len, double timeout) {
 	int32_t r;
 
-	if (!libusb_teensy_handle) return 0;
+	if (!h) return 0;
 	while (timeout > 0) {
-		r = usb_control_msg(libusb_teensy_handle, 0x21, 9, 0x0200, 0,
+		r = usb_control_msg(h, 0x21, 9, 0x0200, 0,
 			(char *)buf, len, (int32_t)(timeout * 1000.0));
 		if (r >= 0) return 1;
+		__atomic_add_fetch(&timings.write_retries, 1, __ATOMIC_RELAXED);	// sync_boot writes from threads
+		TRACE2(retry, r, (int32_t)(timeout * 1000.0));
 		usleep(10000);
 		timeout -= 0.01;
 	}
 	return 0;
 }
 
+int32_t teensy_write(void *buf, int32_t len, double timeout) {
+	if (hidraw_transport) return hidraw_write(hidraw_teensy.fd, buf, len, timeout);
+	return libusb_write(libusb_teensy_handle, buf, len, timeout);
+}
+
+/* every HalfKay device at once, for sync_boot (independent of teensy_open) */
+static usb_dev_handle *libusb_boot_handles[SYNC_BOOT_MAX];
+static struct hidraw_dev hidraw_boot_devs[SYNC_BOOT_MAX];
+static int32_t libusb_boot_count = 0;
+
+int32_t teensy_open_all(int32_t max) {
+	teensy_close_all();
+	if (max > SYNC_BOOT_MAX) max = SYNC_BOOT_MAX;
+	if (hidraw_transport) libusb_boot_count = hidraw_open_devices(0x16C0, 0x0478, hidraw_boot_devs, max);
+	else libusb_boot_count = open_usb_devices(0x16C0, 0x0478, libusb_boot_handles, max);
+	return libusb_boot_count;
+}
+
+int32_t teensy_write_to(int32_t index, void *buf, int32_t len, double timeout) {
+	if (index < 0 || index >= libusb_boot_count) return 0;
+	if (hidraw_transport) return hidraw_write(hidraw_boot_devs[index].fd, buf, len, timeout);
+	return libusb_write(libusb_boot_handles[index], buf, len, timeout);
+}
+
+void teensy_close_all(void) {
+	for (int32_t i = 0; i < libusb_boot_count; i++) {
+		if (hidraw_transport) {
+			hidraw_close(&hidraw_boot_devs[i]);
+			continue;
+		}
+		usb_release_interface(libusb_boot_handles[i], 0);
+		usb_close(libusb_boot_handles[i]);
+		TRACE0(device_close);
+	}
+	libusb_boot_count = 0;
+}
+
 void teensy_close(void) {
+	hidraw_close(&hidraw_teensy);
 	if (!libusb_teensy_handle) return;
 	usb_release_interface(libusb_teensy_handle, 0);
 	usb_close(libusb_teensy_handle);
+	TRACE0(device_close);
 	libusb_teensy_handle = NULL;
 }
 
@@ -256,6 +1103,7 @@ int32_t teensy_hard_reboot(void) {
 
 	rebootor = open_usb_device(0x16C0, 0x0477);
 	if (!rebootor) return 0;
+	TRACE1(reboot_issued, 0);	// 0 = hard reboot
 	r = usb_control_msg(rebootor, 0x21, 9, 0x0200, 0, "reboot", 6, 100);
 	usb_release_interface(rebootor, 0);
 	usb_close(rebootor);
@@ -274,6 +1122,7 @@ int32_t teensy_soft_reboot(void) {
 	}
 
 	char reboot_command[] = {0x86, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08};
+	TRACE1(reboot_issued, 1);	// 1 = soft reboot
 	int32_t response = usb_control_msg(serial_handle, 0x21, 0x20, 0, 0, reboot_command, sizeof reboot_command, 10000);
 
 	usb_release_interface(serial_handle, 0);
@@ -288,16 +1137,24 @@ int32_t teensy_soft_reboot(void) {
 	return 1;
 }
 
+#endif	// !USE_SIMULATOR
+
 
 /*****************************/
 /*    Read Intel Hex File    */
 /*****************************/
 
-/* maximum flash image size supported (without using a bigger chip) */
-#define MAX_MEMORY_SIZE 0x1000000
-
-static uint8_t	firmware_image[MAX_MEMORY_SIZE];
-static uint8_t	firmware_mask[MAX_MEMORY_SIZE];
+/*
+*  the parser always fills the private buffers; firmware_image/firmware_mask
+*  point at them, or at a read-only shared image (see image_load), in which
+*  case image_limit shrinks to the size of the mapped arrays.
+*/
+static uint8_t	firmware_image_buf[MAX_MEMORY_SIZE] __attribute__((aligned(4096)));
+static uint8_t	firmware_mask_buf[MAX_MEMORY_SIZE] __attribute__((aligned(4096)));
+static uint8_t	*firmware_image = firmware_image_buf;
+static uint8_t	*firmware_mask = firmware_mask_buf;
+static int32_t	image_limit = MAX_MEMORY_SIZE;
+static int32_t	image_lo = MAX_MEMORY_SIZE, image_hi = 0;	// range the last parse touched
 static int32_t 	end_record_seen = false;
 static int32_t 	byte_count;
 static uint32_t	extended_addr = 0;
@@ -305,22 +1162,38 @@ static int32_t 	ihex_parse_line(char *line);
 
 int32_t ihex_read(const char *filename) {
 	FILE *fp;
-	int32_t i, lineno = 0;
-	char buf[1024];
-
-	byte_count = 0;
-	end_record_seen = 0;
-	for (i = 0; i < MAX_MEMORY_SIZE; i++) {
-		firmware_image[i] = 0xFF;
-		firmware_mask[i] = 0;
-	}
-	extended_addr = 0;
+	int32_t num;
 
 	fp = fopen(filename, "r");
 	if (fp == NULL) {
 		printf("unable to open file \"%s\"\n", filename);
 		return -1;
 	}
+	num = ihex_read_stream(fp, filename);
+	fclose(fp);
+	return num;
+}
+
+
+int32_t ihex_read_stream(FILE *fp, const char *filename) {
+	int32_t lineno = 0;
+	char buf[1024];
+
+	byte_count = 0;
+	end_record_seen = 0;
+	firmware_image = firmware_image_buf;
+	firmware_mask = firmware_mask_buf;
+	image_limit = MAX_MEMORY_SIZE;
+	/*
+	*  every reader checks the mask before the image, so clearing the mask
+	*  over the range the previous parse wrote resets the resident image
+	*  (the rest is still zero), rather than touching all 32 MB per parse.
+	*/
+	if (image_hi > image_lo) memset(firmware_mask + image_lo, 0, image_hi - image_lo);
+	image_lo = MAX_MEMORY_SIZE;
+	image_hi = 0;
+	extended_addr = 0;
+
 	while (!feof(fp)) {
 		*buf = '\0';
 		if (!fgets(buf, sizeof(buf), fp)) break;
@@ -334,7 +1207,6 @@ int32_t ihex_read(const char *filename) {
 		if (end_record_seen) break;
 		if (feof(stdin)) break;
 	}
-	fclose(fp);
 	return byte_count;
 }
 
@@ -390,9 +1262,12 @@ int addr, code, num;
 				extended_addr -= 0x60000000;	// Teensy 4.0 hex files have 0x60000000 FlexSPI offset
 			}
 		}
+		TRACE3(record_parsed, addr + extended_addr, len, code);
 		return 1;	// non-data line
 	}
 	byte_count += len;
+	if (addr + (int32_t) extended_addr < image_lo) image_lo = addr + extended_addr;
+	if (addr + (int32_t) extended_addr + len > image_hi) image_hi = addr + extended_addr + len;
 	while (num != len) {
 		if (sscanf(ptr, "%02x", &i) != 1) return 0;
 		i &= 255;
@@ -405,11 +1280,12 @@ int addr, code, num;
 	}
 	if (!sscanf(ptr, "%02x", &cksum)) return 0;
 	if (((sum & 255) + (cksum & 255)) & 255) return 0;	// checksum error
+	TRACE3(record_parsed, addr + extended_addr, len, code);
 	return 1;
 }
 
 int32_t ihex_bytes_in_range(int32_t begin, int32_t end) {
-	if (begin < 0 || begin >= MAX_MEMORY_SIZE || end < 0 || end >= MAX_MEMORY_SIZE)
+	if (begin < 0 || begin >= image_limit || end < 0 || end >= image_limit)
 		return 0;
 
 	for (int32_t i = begin; i <= end; i++)
@@ -420,26 +1296,27 @@ int32_t ihex_bytes_in_range(int32_t begin, int32_t end) {
 
 void ihex_get_data(int32_t addr, int32_t len, uint8_t *bytes) {
 	int32_t i;
-	if (addr < 0 || len < 0 || addr + len >= MAX_MEMORY_SIZE) {
+	if (low_memory) return lowmem_get_data(addr, len, bytes);
+	if (addr < 0 || len < 0 || addr + len >= image_limit) {
 		for (i = 0; i < len; i++) {
 			bytes[i] = 255;
 		}
 		return;
 	}
-	for (int32_t i = 0; i < len; i++) {
-		if (firmware_mask[addr]) {
-			bytes[i] = firmware_image[addr];
-		} else {
-			bytes[i] = 255;
-		}
-		addr++;
+	for (i = 0; i < len; i++) {	// branchless so it vectorizes
+		bytes[i] = firmware_mask[addr + i] ? firmware_image[addr + i] : 255;
 	}
 }
 
+int32_t ihex_block_is_dirty(int32_t addr, int32_t block_size) {
+	if (!ihex_bytes_in_range(addr, addr + block_size - 1)) return 0;
+	return !ihex_memory_is_blank(addr, block_size);
+}
+
 int32_t ihex_memory_is_blank(int32_t addr, int32_t block_size) {
-	if (addr < 0 || addr > MAX_MEMORY_SIZE) return 1;
+	if (addr < 0 || addr > image_limit) return 1;
 
-	while (block_size && addr < MAX_MEMORY_SIZE) {
+	while (block_size && addr < image_limit) {
 		if (firmware_mask[addr] && firmware_image[addr] != 255) return 0;
 		addr++;
 		block_size--;
@@ -447,23 +1324,817 @@ int32_t ihex_memory_is_blank(int32_t addr, int32_t block_size) {
 	return 1;
 }
 
+static char *ihex_put_byte(char *p, uint8_t b, uint8_t *sum) {
+	static const char hex[] = "0123456789ABCDEF";
 
-/*********************************/
-/*    Miscellaneous Functions    */
-/*********************************/
+	*p++ = hex[b >> 4];
+	*p++ = hex[b & 15];
+	*sum += b;
+	return p;
+}
 
-void usage(const char *err) {
-	if(err != NULL) fprintf(stderr, "%s\n\n", err);
-	fprintf(stderr,
-		"usage: teensy-loader --mcu=<MCU> [-w] [-h] [-n] [-b] [-v] <file.hex>\n"
-		"\t-w : wait for device to appear\n"
-		"\t-r : use hard reboot if device not online\n"
-		"\t-s : use soft reboot if device not online (Teensy 3.x & 4.x)\n"
-		"\t-n : no reboot after programming\n"
-		"\t-b : boot only, do not program\n"
-		"\t-v : verbose output\n"
-		"\nUse `teensy-loader --list-mcus` to list supported mcus.\n"
-		);
+#define IHEX_RECORD_OVERHEAD	6	// ":LLAAAATT" and "CC\n" take the text of 5.5 data bytes
+
+static void ihex_write_record(FILE *fp, int32_t addr, int32_t type, const uint8_t *data, int32_t len) {
+	char line[16 + 2 * 255], *p = line;
+	uint8_t sum = 0;
+
+	*p++ = ':';
+	p = ihex_put_byte(p, len, &sum);
+	p = ihex_put_byte(p, (addr >> 8) & 255, &sum);
+	p = ihex_put_byte(p, addr & 255, &sum);
+	p = ihex_put_byte(p, type, &sum);
+	for (int32_t i = 0; i < len; i++) p = ihex_put_byte(p, data[i], &sum);
+	p = ihex_put_byte(p, -sum, &sum);
+	*p++ = '\n';
+	fwrite(line, 1, p - line, fp);
+}
+
+/* length of the run of 0xFF image bytes starting at addr, up to limit */
+static int32_t ihex_blank_run(int32_t addr, int32_t limit) {
+	int32_t end = addr;
+
+	while (end < limit && firmware_mask[end] && firmware_image[end] == 0xFF) end++;
+	return end - addr;
+}
+
+/*
+*  write the loaded image as canonical intel hex: ascending addresses, data
+*  records of up to 255 bytes (the longest ihex_parse_line accepts) that never
+*  cross a 64K boundary, and a type 04 record only when the upper address
+*  changes. Teensy 4.x images get their 0x60000000 FlexSPI offset back so other
+*  loaders read them as before. with drop_blank, bytes equal to 0xFF are left
+*  out (HalfKay erases to 0xFF anyway). start address records are not kept.
+*  returns the number of records written, or -1 on error.
+*/
+int32_t ihex_write(const char *path, bool drop_blank) {
+	uint32_t offset = 0, segment = 0, out;
+	int32_t addr = 0, end, limit, run, records = 0;
+	uint8_t ext[2];
+	FILE *fp;
+
+	if (code_size > 1048576 && block_size >= 1024) offset = 0x60000000;
+	fp = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if (!fp) return -1;
+	while (addr < code_size) {
+		if (!firmware_mask[addr] || (drop_blank && firmware_image[addr] == 0xFF)) {
+			addr++;
+			continue;
+		}
+		limit = (addr | 0xFFFF) + 1;
+		if (limit > addr + 255) limit = addr + 255;
+		if (limit > code_size) limit = code_size;
+		for (end = addr + 1; end < limit && firmware_mask[end]; end++) {
+			if (!drop_blank || firmware_image[end] != 0xFF) continue;
+			// a blank run inside a record is cheaper to keep than a new record header
+			run = ihex_blank_run(end, limit);
+			if (run >= IHEX_RECORD_OVERHEAD || end + run == limit || !firmware_mask[end + run]) break;
+			end += run - 1;
+		}
+		out = addr + offset;
+		if (out >> 16 != segment) {
+			segment = out >> 16;
+			ext[0] = segment >> 8;
+			ext[1] = segment & 255;
+			ihex_write_record(fp, 0, 4, ext, 2);
+			records++;
+		}
+		ihex_write_record(fp, out & 0xFFFF, 0, firmware_image + addr, end - addr);
+		records++;
+		addr = end;
+	}
+	ihex_write_record(fp, 0, 1, NULL, 0);
+	records++;
+	if (fp != stdout ? fclose(fp) : fflush(fp)) return -1;
+	printf_verbose("wrote %d records to \"%s\"\n", records, path);
+	return records;
+}
+
+/*************************/
+/*    Bulk Validation    */
+/*************************/
+
+/*
+*  --validate checks every file named on the command line on a pool of
+*  threads. each file is mapped and scanned once by a reentrant checker that
+*  keeps no image, only counters, so it reports every error (with its line)
+*  instead of stopping at the first one like ihex_read. the checks follow
+*  ihex_parse_line: checksums, record lengths, 16 MB overflow and, with
+*  --mcu, data outside the chip's flash. reports are printed in command line
+*  order once all files are done.
+*/
+#define VALIDATE_MAX_ERRORS	100	// listed per file, all are counted
+
+struct validate_file {
+	const char *path;
+	int64_t	 size;
+	int32_t	 lines, records, data_bytes, errors;
+	uint64_t elapsed_ns;
+	char	*report;	// error lines, from open_memstream
+	size_t	 report_len;
+};
+
+static struct validate_file	*validate_files;
+static int32_t			 validate_count;
+static atomic_int		 validate_next;
+
+static int32_t hex_digit(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+static void validate_error(struct validate_file *f, FILE *out, int32_t line, const char *msg) {
+	if (f->errors++ >= VALIDATE_MAX_ERRORS) return;
+	if (line) fprintf(out, "%s:%d: %s\n", f->path, line, msg);
+	else fprintf(out, "%s: %s\n", f->path, msg);
+}
+
+/* check one record (without line ending), updating f and the extended address */
+static void validate_record(struct validate_file *f, FILE *out, const char *p, size_t n,
+			    uint32_t *ext, bool *end_seen) {
+	uint8_t rec[5 + 255];
+	int32_t hi, lo, len, addr, type;
+	uint32_t abs;
+	uint8_t sum = 0;
+
+	if (n == 0 || p[0] != ':') return validate_error(f, out, f->lines, "missing ':' record mark");
+	if (n < 11 || !(n & 1)) return validate_error(f, out, f->lines, "truncated record");
+	if (n > 11 + 2 * 255) return validate_error(f, out, f->lines, "record longer than 255 data bytes");
+	for (size_t i = 1; i < n; i += 2) {
+		if ((hi = hex_digit(p[i])) < 0 || (lo = hex_digit(p[i + 1])) < 0)
+			return validate_error(f, out, f->lines, "invalid hex digit");
+		rec[i / 2] = hi << 4 | lo;
+		sum += rec[i / 2];
+	}
+	len = rec[0];
+	addr = rec[1] << 8 | rec[2];
+	type = rec[3];
+	if ((size_t) len != (n - 11) / 2) return validate_error(f, out, f->lines, "record length does not match its data");
+	if (sum) return validate_error(f, out, f->lines, "checksum error");
+	f->records++;
+	if (*end_seen) return validate_error(f, out, f->lines, "record after end of file record");
+
+	switch (type) {
+	case 0:
+		abs = *ext + addr;
+		f->data_bytes += len;
+		if (abs + len >= MAX_MEMORY_SIZE) validate_error(f, out, f->lines, "data beyond the 16 MB image limit");
+		else if (code_size && abs + len > (uint32_t) code_size) validate_error(f, out, f->lines, "data outside the mcu's flash");
+		break;
+	case 1:
+		if (len) validate_error(f, out, f->lines, "end of file record with data");
+		*end_seen = true;
+		break;
+	case 2:
+	case 4:
+		if (len != 2) return validate_error(f, out, f->lines, "extended address record length is not 2");
+		*ext = type == 2 ? (uint32_t)(rec[4] << 8 | rec[5]) << 4 : (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+		if (type == 4 && (!code_size || (code_size > 1048576 && block_size >= 1024)) &&
+		    *ext >= 0x60000000 && *ext < 0x60000000u + (code_size ? code_size : MAX_MEMORY_SIZE))
+			*ext -= 0x60000000;	// FlexSPI offset, as in ihex_parse_line (any image without --mcu)
+		break;
+	case 3:
+	case 5:
+		if (len != 4) validate_error(f, out, f->lines, "start address record length is not 4");
+		break;
+	default:
+		validate_error(f, out, f->lines, "unknown record type");
+	}
+}
+
+static void validate_one(struct validate_file *f) {
+	const char *data, *p, *end, *nl;
+	uint64_t t = monotonic_ns();
+	uint32_t ext = 0;
+	bool end_seen = false;
+	struct stat st;
+	size_t n;
+	FILE *out;
+	int fd;
+
+	if (!(out = open_memstream(&f->report, &f->report_len))) return;
+	if ((fd = open(f->path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		validate_error(f, out, 0, strerror(errno));
+		if (fd >= 0) close(fd);
+		fclose(out);
+		return;
+	}
+	f->size = st.st_size;
+	data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		validate_error(f, out, 0, st.st_size ? strerror(errno) : "empty file");
+		fclose(out);
+		return;
+	}
+	madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+	for (p = data, end = data + st.st_size; p < end; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', end - p))) nl = end;
+		n = nl - p;
+		if (n && p[n - 1] == '\r') n--;
+		f->lines++;
+		validate_record(f, out, p, n, &ext, &end_seen);
+	}
+	if (!end_seen) validate_error(f, out, f->lines, "no end of file record");
+	munmap((void *) data, st.st_size);
+	if (f->errors > VALIDATE_MAX_ERRORS)
+		fprintf(out, "%s: %d more errors not shown\n", f->path, f->errors - VALIDATE_MAX_ERRORS);
+	fclose(out);
+	f->elapsed_ns = monotonic_ns() - t;
+}
+
+static void *validate_thread(void *arg) {
+	int32_t i;
+
+	(void) arg;
+	while ((i = atomic_fetch_add(&validate_next, 1)) < validate_count) validate_one(&validate_files[i]);
+	return NULL;
+}
+
+/* validate paths in parallel and report; returns the number of files with errors */
+int32_t validate_files_parallel(char **paths, int32_t count) {
+	pthread_t threads[64];
+	int32_t nthreads, bad = 0;
+	int64_t total = 0;
+	uint64_t t = monotonic_ns();
+
+	if (!(validate_files = calloc(count, sizeof(*validate_files)))) die("out of memory");
+	for (int32_t i = 0; i < count; i++) validate_files[i].path = paths[i];
+	validate_count = count;
+	atomic_store(&validate_next, 0);
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > 64) nthreads = 64;
+	if (nthreads > count) nthreads = count;
+	if (nthreads < 1) nthreads = 1;
+	for (int32_t i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, validate_thread, NULL)) die("unable to start validation thread");
+	}
+	for (int32_t i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+	for (int32_t i = 0; i < count; i++) {
+		struct validate_file *f = &validate_files[i];
+
+		if (f->report_len) fwrite(f->report, 1, f->report_len, stdout);
+		printf("%s: %s, %lld bytes, %d records, %d data bytes", f->path, f->errors ? "FAILED" : "ok",
+			(long long) f->size, f->records, f->data_bytes);
+		if (code_size) printf(", %.1f%% usage", (double) f->data_bytes / (double) code_size * 100.0);
+		if (f->errors) printf(", %d errors", f->errors);
+		printf(", %.3f ms\n", f->elapsed_ns / 1e6);
+		total += f->size;
+		if (f->errors) bad++;
+		free(f->report);
+	}
+	printf("validated %d files (%.1f MB) on %d threads in %.3f ms, %d with errors\n", count,
+		total / 1048576.0, nthreads, (monotonic_ns() - t) / 1e6, bad);
+	free(validate_files);
+	return bad;
+}
+
+
+/*****************************/
+/*    Low-Memory Flashing    */
+/*****************************/
+
+/*
+*  --low-memory never builds the image. a single pass over the mapped hex
+*  file records, for every block that data lands in, the span of file
+*  offsets holding its records, the extended address in effect at the start
+*  of that span and whether any of its bytes differ from 0xFF. ihex_get_data
+*  then rebuilds a block on demand by rescanning only its span, so memory is
+*  one small entry per block touched plus a packet, independent of code_size.
+*  unsorted files work too, their spans are just longer. the mapped file is
+*  clean page cache: it counts
+*  towards rss while resident, but is shared with every process flashing the
+*  same file and the kernel can drop it under memory pressure, unlike the
+*  image and mask arrays (see rss_anon_kb in --timings=json). the flash reads
+*  the file as it goes, so an in-place rewrite (a new file renamed over it is
+*  fine, the mapping keeps the old one) stops it: the file's size and mtime
+*  are checked before the erase and after the last block, a record that no
+*  longer decodes aborts, and a truncation (SIGBUS) exits with a message.
+*/
+struct lowmem_block {
+	int32_t	 addr;
+	uint32_t first_off;	// start of the first line holding data for the block
+	uint32_t end_off;	// end of the last such line
+	uint32_t ext_base;	// extended address in effect at first_off
+	bool	 dirty;
+};
+
+struct lowmem_record {
+	int32_t	len, addr, type;
+	uint8_t	data[255];
+};
+
+static const char		*lowmem_data = NULL;
+static size_t			 lowmem_size;
+static const char		*lowmem_path;
+static int			 lowmem_fd = -1;	// kept open to fstat for in-place rewrites
+static struct stat		 lowmem_st;
+static struct lowmem_block	*lowmem_blocks = NULL;
+static int32_t			 lowmem_count, lowmem_cap;
+static int32_t			*lowmem_hash = NULL;	// open addressing on the block address, entry + 1
+static int32_t			 lowmem_hash_size;
+
+static uint32_t lowmem_slot(int32_t addr) {
+	return ((uint32_t)(addr / block_size) * 2654435761u) & (lowmem_hash_size - 1);
+}
+
+static int32_t lowmem_lookup(int32_t addr) {
+	if (!lowmem_hash) return -1;
+	for (uint32_t h = lowmem_slot(addr); lowmem_hash[h]; h = (h + 1) & (lowmem_hash_size - 1)) {
+		if (lowmem_blocks[lowmem_hash[h] - 1].addr == addr) return lowmem_hash[h] - 1;
+	}
+	return -1;
+}
+
+static struct lowmem_block *lowmem_add(int32_t addr, uint32_t off, uint32_t ext) {
+	uint32_t h;
+
+	if (lowmem_count == lowmem_cap) {
+		lowmem_cap = lowmem_cap ? lowmem_cap * 2 : 64;
+		if (!(lowmem_blocks = realloc(lowmem_blocks, sizeof(*lowmem_blocks) * lowmem_cap))) die("out of memory");
+	}
+	if (2 * (lowmem_count + 1) > lowmem_hash_size) {	// keep the table at most half full
+		free(lowmem_hash);
+		lowmem_hash_size = lowmem_hash_size ? lowmem_hash_size * 2 : 128;
+		if (!(lowmem_hash = calloc(lowmem_hash_size, sizeof(int32_t)))) die("out of memory");
+		for (int32_t i = 0; i < lowmem_count; i++) {
+			for (h = lowmem_slot(lowmem_blocks[i].addr); lowmem_hash[h]; h = (h + 1) & (lowmem_hash_size - 1));
+			lowmem_hash[h] = i + 1;
+		}
+	}
+	for (h = lowmem_slot(addr); lowmem_hash[h]; h = (h + 1) & (lowmem_hash_size - 1));
+	lowmem_hash[h] = lowmem_count + 1;
+	lowmem_blocks[lowmem_count] = (struct lowmem_block) { addr, off, off, ext, false };
+	return &lowmem_blocks[lowmem_count++];
+}
+
+/* decode the record in p[0..n), false if it is malformed or fails its checksum */
+static bool lowmem_decode(const char *p, size_t n, struct lowmem_record *r) {
+	int32_t hi, lo, v[4];
+	uint8_t sum = 0;
+
+	if (n < 11 || p[0] != ':' || !(n & 1)) return false;
+	for (int32_t i = 0; i < 4; i++) {
+		if ((hi = hex_digit(p[1 + 2 * i])) < 0 || (lo = hex_digit(p[2 + 2 * i])) < 0) return false;
+		v[i] = hi << 4 | lo;
+		sum += v[i];
+	}
+	r->len = v[0];
+	r->addr = v[1] << 8 | v[2];
+	r->type = v[3];
+	if (n < (size_t)(11 + 2 * r->len)) return false;
+	for (int32_t i = 0; i <= r->len; i++) {	// data bytes, then the checksum
+		if ((hi = hex_digit(p[9 + 2 * i])) < 0 || (lo = hex_digit(p[10 + 2 * i])) < 0) return false;
+		if (i < r->len) r->data[i] = hi << 4 | lo;
+		sum += hi << 4 | lo;
+	}
+	return sum == 0;
+}
+
+/* the extended address after record r, with ihex_parse_line's Teensy 4 offset */
+static uint32_t lowmem_ext(const struct lowmem_record *r, uint32_t ext) {
+	uint32_t v;
+
+	if (r->len != 2 || (r->type != 2 && r->type != 4)) return ext;
+	v = r->data[0] << 8 | r->data[1];
+	if (r->type == 2) return v << 4;
+	v <<= 16;
+	if (code_size > 1048576 && block_size >= 1024 && v >= 0x60000000 && v < 0x60000000u + code_size)
+		v -= 0x60000000;
+	return v;
+}
+
+/* next line of the mapped file after p, with its length (without line ending) in *n */
+static const char *lowmem_line(const char *p, size_t *n) {
+	const char *end = lowmem_data + lowmem_size, *nl = memchr(p, '\n', end - p);
+
+	*n = (nl ? nl : end) - p;
+	if (*n && p[*n - 1] == '\r') (*n)--;
+	return nl ? nl + 1 : end;
+}
+
+static void lowmem_sigbus(int sig) {
+	static const char msg[] = "hex file truncated while flashing from it\n";
+	ssize_t r;
+
+	(void) sig;
+	r = write(STDERR_FILENO, msg, sizeof(msg) - 1);	// async-signal-safe, unlike die()
+	(void) r;
+	_exit(1);
+}
+
+int32_t lowmem_load(const char *path) {
+	const char *p, *next, *end;
+	struct lowmem_record r;
+	struct lowmem_block *b;
+	int32_t lineno = 0, bytes = 0, blk, idx, i;
+	uint32_t ext = 0, abs;
+	struct stat st;
+	size_t n;
+	int fd;
+
+	if (lowmem_data) munmap((void *) lowmem_data, lowmem_size);
+	if (lowmem_fd >= 0) close(lowmem_fd);
+	lowmem_data = NULL;
+	lowmem_fd = -1;
+	lowmem_count = 0;
+	if (lowmem_hash) memset(lowmem_hash, 0, sizeof(int32_t) * lowmem_hash_size);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > UINT32_MAX) {
+		printf("unable to open file \"%s\"\n", path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	lowmem_size = st.st_size;
+	lowmem_data = mmap(NULL, lowmem_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (lowmem_data == MAP_FAILED) {
+		lowmem_data = NULL;
+		close(fd);
+		printf("unable to map file \"%s\"\n", path);
+		return -1;
+	}
+	lowmem_path = path;
+	lowmem_fd = fd;
+	lowmem_st = st;
+	signal(SIGBUS, lowmem_sigbus);
+	madvise((void *) lowmem_data, lowmem_size, MADV_SEQUENTIAL);
+
+	for (p = lowmem_data, end = lowmem_data + lowmem_size; p < end; p = next) {
+		next = lowmem_line(p, &n);
+		lineno++;
+		if (!lowmem_decode(p, n, &r)) {
+			printf("hex parse error - line %d in file \"%s\"\n", lineno, path);
+			return -2;
+		}
+		if (r.type == 1) break;
+		if (r.type != 0) {
+			ext = lowmem_ext(&r, ext);
+			continue;
+		}
+		abs = ext + r.addr;
+		if (abs + r.len >= MAX_MEMORY_SIZE) {
+			printf("hex parse error - line %d in file \"%s\"\n", lineno, path);
+			return -2;
+		}
+		bytes += r.len;
+		for (i = 0; i < r.len; ) {	// every block the record overlaps
+			blk = (abs + i) - (abs + i) % block_size;
+			idx = lowmem_lookup(blk);
+			b = idx >= 0 ? &lowmem_blocks[idx] : lowmem_add(blk, p - lowmem_data, ext);
+			b->end_off = next - lowmem_data;
+			for (; i < r.len && (int32_t)(abs + i) < b->addr + block_size; i++) {
+				if (r.data[i] != 0xFF) b->dirty = true;
+			}
+		}
+	}
+	madvise((void *) lowmem_data, lowmem_size, MADV_RANDOM);
+	printf_verbose("low-memory index: %d blocks touched, %.1f kB\n", lowmem_count,
+		(sizeof(*lowmem_blocks) * lowmem_cap + sizeof(int32_t) * lowmem_hash_size) / 1024.0);
+	return bytes;
+}
+
+static int compare_int32(const void *a, const void *b) {
+	return *(const int32_t *) a - *(const int32_t *) b;
+}
+
+/* plan_blocks for the index: block 0, then every dirty block, ascending */
+int32_t lowmem_plan(int32_t *plan) {
+	int32_t n = 0;
+
+	plan[n++] = 0;
+	for (int32_t i = 0; i < lowmem_count; i++) {
+		if (lowmem_blocks[i].dirty && lowmem_blocks[i].addr && lowmem_blocks[i].addr < code_size)
+			plan[n++] = lowmem_blocks[i].addr;
+	}
+	qsort(plan + 1, n - 1, sizeof(int32_t), compare_int32);
+	return n;
+}
+
+/* ihex_get_data for the index: replay the records in each block's span, later ones win */
+void lowmem_get_data(int32_t addr, int32_t len, uint8_t *bytes) {
+	const struct lowmem_block *b;
+	const char *p, *line, *end;
+	struct lowmem_record r;
+	int32_t lo, hi, i;
+	uint32_t ext;
+	size_t n;
+
+	memset(bytes, 0xFF, len);
+	for (int32_t blk = addr - addr % block_size; blk < addr + len; blk += block_size) {
+		if ((i = lowmem_lookup(blk)) < 0) continue;
+		b = &lowmem_blocks[i];
+		ext = b->ext_base;
+		for (p = lowmem_data + b->first_off, end = lowmem_data + b->end_off; p < end; ) {
+			line = p;
+			p = lowmem_line(line, &n);
+			if (!lowmem_decode(line, n, &r))	// it did when lowmem_load indexed it
+				die_cause("file_changed", "\"%s\" was rewritten while flashing from it", lowmem_path);
+			if (r.type != 0) {
+				ext = lowmem_ext(&r, ext);
+				continue;
+			}
+			lo = ext + r.addr;
+			hi = lo + r.len;
+			if (lo < blk) lo = blk;
+			if (lo < addr) lo = addr;
+			if (hi > blk + block_size) hi = blk + block_size;
+			if (hi > addr + len) hi = addr + len;
+			if (lo < hi) memcpy(bytes + lo - addr, r.data + lo - (int32_t)(ext + r.addr), hi - lo);
+		}
+	}
+}
+
+/* die if the mapped file was written in place since lowmem_load indexed it */
+void lowmem_check(void) {
+	struct stat st;
+
+	if (lowmem_fd < 0) return;
+	if (fstat(lowmem_fd, &st) < 0 || st.st_size != lowmem_st.st_size ||
+	    st.st_mtim.tv_sec != lowmem_st.st_mtim.tv_sec || st.st_mtim.tv_nsec != lowmem_st.st_mtim.tv_nsec)
+		die_cause("file_changed", "\"%s\" was rewritten while flashing from it", lowmem_path);
+}
+
+
+/****************************/
+/*    Shared Image Store    */
+/****************************/
+
+/*
+*  with --shared-image the parsed image, mask and block plan are published in
+*  a private per-user directory under /dev/shm keyed by the content hash of
+*  the hex file and the mcu, so concurrent processes flashing the same
+*  firmware parse it once and all map a single read-only copy. the hex file
+*  is read once and the same bytes are hashed and parsed, so a rewrite in
+*  between cannot publish an image under the wrong hash. the file is written
+*  under a temporary name and linked into place only when complete, so
+*  readers never see a partial image; the per-image lock makes the other
+*  processes wait for the first parse instead of repeating it. mapping an
+*  image marks it used, and only the most recently used ones are kept.
+*/
+#define SHARED_IMAGE_DIR	"/dev/shm"
+#define SHARED_IMAGE_KEEP	4
+#define SHARED_IMAGE_MAGIC	"TLIMAGE1"
+#define SHARED_HEADER_SIZE	4096	// keeps the image page aligned
+
+struct shared_image_header {
+	char	 magic[8];
+	uint64_t hash;
+	int32_t	 code_size;
+	int32_t	 block_size;
+	int32_t	 byte_count;
+	int32_t	 plan_count;
+};
+
+static void	*shared_map = NULL;
+static size_t	 shared_map_len;
+
+#define FNV_OFFSET		0xcbf29ce484222325ull
+
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t n) {
+	for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+	return h;
+}
+
+/* the whole file in one malloc'd buffer, NULL if it cannot be read or is empty */
+static uint8_t *file_read(const char *filename, size_t *len) {
+	uint8_t *buf = NULL, *p;
+	size_t cap = 0, n;
+	FILE *fp;
+
+	if (!(fp = fopen(filename, "rb"))) return NULL;
+	*len = 0;
+	do {
+		if (*len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			if (!(p = realloc(buf, cap))) {
+				free(buf);
+				fclose(fp);
+				return NULL;
+			}
+			buf = p;
+		}
+		*len += (n = fread(buf + *len, 1, cap - *len, fp));
+	} while (n > 0);
+	fclose(fp);
+	if (*len == 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* the per-user store, trusted only while it is a directory of ours that no one else can enter */
+bool private_shm_dir(char *dir, size_t len, const char *what) {
+	struct stat st;
+
+	snprintf(dir, len, SHARED_IMAGE_DIR "/teensy-loader-%u", (unsigned) geteuid());
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) return false;
+	if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+		fprintf(stderr, "%s: \"%s\" is not a private directory\n", what, dir);
+		return false;
+	}
+	return true;
+}
+
+/* the arrays extend one block past code_size so the bound checks stay as they are */
+static size_t shared_image_size(int32_t plan_count) {
+	return SHARED_HEADER_SIZE + 2 * (size_t)(code_size + block_size) + sizeof(int32_t) * plan_count;
+}
+
+static bool shared_image_map(const char *path, uint64_t hash, int32_t *num) {
+	const struct shared_image_header *hdr;
+	int32_t limit = code_size + block_size;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) < 0) return false;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & 0222) || st.st_size < SHARED_HEADER_SIZE) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) futimens(fd, NULL);	// mark it recently used for shared_image_evict
+	close(fd);
+	if (map == MAP_FAILED) return false;
+	hdr = map;
+	if (memcmp(hdr->magic, SHARED_IMAGE_MAGIC, sizeof(hdr->magic)) || hdr->hash != hash ||
+	    hdr->code_size != code_size || hdr->block_size != block_size || hdr->plan_count < 1 ||
+	    (size_t) st.st_size != shared_image_size(hdr->plan_count)) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	shared_map = map;
+	shared_map_len = st.st_size;
+	firmware_image = (uint8_t *) map + SHARED_HEADER_SIZE;
+	firmware_mask = firmware_image + limit;
+	shared_plan = (const int32_t *)(firmware_mask + limit);
+	shared_plan_count = hdr->plan_count;
+	image_limit = limit;
+	*num = hdr->byte_count;
+	return true;
+}
+
+static void shared_image_publish(const char *path, uint64_t hash, int32_t num) {
+	struct shared_image_header hdr;
+	const int32_t *plan;
+	int32_t limit = code_size + block_size, n = plan_blocks(&plan);
+	size_t plan_len = sizeof(int32_t) * n;
+	char tmp[1024];
+	bool ok;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0444)) < 0) return;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SHARED_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.hash = hash;
+	hdr.code_size = code_size;
+	hdr.block_size = block_size;
+	hdr.byte_count = num;
+	hdr.plan_count = n;
+	ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	     pwrite(fd, firmware_image, limit, SHARED_HEADER_SIZE) == limit &&
+	     pwrite(fd, firmware_mask, limit, SHARED_HEADER_SIZE + limit) == limit &&
+	     pwrite(fd, plan, plan_len, SHARED_HEADER_SIZE + 2 * (off_t) limit) == (ssize_t) plan_len;
+	close(fd);
+	if (ok && link(tmp, path) < 0 && errno != EEXIST)
+		fprintf(stderr, "unable to publish shared image \"%s\": %s\n", path, strerror(errno));
+	unlink(tmp);
+}
+
+/* drop the least recently used images (and their locks) beyond SHARED_IMAGE_KEEP */
+static void shared_image_evict(const char *dir) {
+	char path[1024], oldest[256];
+	struct timespec oldest_mtime = { 0, 0 };
+	struct dirent *de;
+	struct stat st;
+	int32_t count;
+	size_t len;
+	DIR *d;
+
+	for (;;) {
+		if (!(d = opendir(dir))) return;
+		count = 0;
+		while ((de = readdir(d))) {
+			len = strlen(de->d_name);
+			if (len < 4 || strcmp(de->d_name + len - 4, ".img")) continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			if (stat(path, &st) < 0) continue;
+			if (!count++ || st.st_mtim.tv_sec < oldest_mtime.tv_sec ||
+			    (st.st_mtim.tv_sec == oldest_mtime.tv_sec && st.st_mtim.tv_nsec < oldest_mtime.tv_nsec)) {
+				oldest_mtime = st.st_mtim;
+				snprintf(oldest, sizeof(oldest), "%s", de->d_name);
+			}
+		}
+		closedir(d);
+		if (count <= SHARED_IMAGE_KEEP) return;
+		snprintf(path, sizeof(path), "%s/%s", dir, oldest);
+		unlink(path);		// processes that have it mapped keep their copy
+		printf_verbose("evicted shared image %s\n", path);
+		strncat(path, ".lock", sizeof(path) - strlen(path) - 1);
+		unlink(path);
+	}
+}
+
+/* ihex_read, or map the image another process already parsed */
+int32_t image_load(const char *filename) {
+	char dir[256], path[1024];
+	uint8_t *text;
+	size_t text_len;
+	uint64_t hash;
+	int32_t num;
+	FILE *fp;
+	int lock;
+
+	if (low_memory) return lowmem_load(filename);
+	if (shared_map) {
+		munmap(shared_map, shared_map_len);
+		shared_map = NULL;
+		shared_plan = NULL;
+	}
+	if (!shared_image || !private_shm_dir(dir, sizeof(dir), "not sharing the image") || !(text = file_read(filename, &text_len)))
+		return ihex_read(filename);
+	hash = fnv1a(FNV_OFFSET, text, text_len);
+
+	snprintf(path, sizeof(path), "%s/%s-%016llx.img", dir, mcu_name, (unsigned long long) hash);
+	if (shared_image_map(path, hash, &num)) {
+		printf_verbose("mapped shared image %s\n", path);
+		free(text);
+		return num;
+	}
+
+	strcat(path, ".lock");
+	lock = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	if (lock >= 0) flock(lock, LOCK_EX);
+	path[strlen(path) - 5] = '\0';
+	if (shared_image_map(path, hash, &num)) {	// published while we waited for the lock
+		printf_verbose("mapped shared image %s\n", path);
+	} else if ((fp = fmemopen(text, text_len, "r"))) {
+		num = ihex_read_stream(fp, filename);	// the bytes that were hashed
+		fclose(fp);
+		if (num >= 0) {
+			shared_image_publish(path, hash, num);
+			shared_image_evict(dir);
+		}
+		if (num >= 0 && shared_image_map(path, hash, &num)) {
+			madvise(firmware_image_buf, sizeof(firmware_image_buf), MADV_DONTNEED);
+			madvise(firmware_mask_buf, sizeof(firmware_mask_buf), MADV_DONTNEED);
+			image_lo = MAX_MEMORY_SIZE;	// the buffers read back as zero now
+			image_hi = 0;
+			printf_verbose("published shared image %s\n", path);
+		}
+	} else {
+		num = ihex_read(filename);
+	}
+	if (lock >= 0) close(lock);
+	free(text);
+	return num;
+}
+
+
+/*********************************/
+/*    Miscellaneous Functions    */
+/*********************************/
+
+void usage(const char *err) {
+	if(err != NULL) fprintf(stderr, "%s\n\n", err);
+	fprintf(stderr,
+		"usage: teensy-loader --mcu=<MCU> [-w] [-h] [-n] [-b] [-v] <file.hex>\n"
+		"\t-w : wait for device to appear\n"
+		"\t-r : use hard reboot if device not online\n"
+		"\t-s : use soft reboot if device not online (Teensy 3.x & 4.x)\n"
+		"\t-n : no reboot after programming\n"
+		"\t-b : boot only, do not program\n"
+		"\t-v : verbose output\n"
+		"\t--sync-boot=<N> : boot N waiting HalfKay boards at the same instant\n"
+		"\t--validate : check every given hex file in parallel, report all errors\n"
+		"\t--watch : stay running and reflash whenever the hex file is rewritten\n"
+		"\t--dry-run : print the block plan and estimated flash time, no usb\n"
+		"\t--diff <old.hex> : list blocks that differ from old.hex, no usb\n"
+		"\t--normalize=<out.hex> : write the image as canonical intel hex, no usb\n"
+		"\t--drop-blank : with --normalize, omit bytes that are 0xFF\n"
+		"\t--worker=<port> : run flash jobs for a coordinator on this tcp port (loopback)\n"
+		"\t--listen=<host:port> : run the worker on this address instead\n"
+		"\t--coordinator : read \"<mcu> <file.hex>\" jobs from stdin, run them on stations\n"
+		"\t--station=<host:port|local> : add a worker station (repeatable)\n"
+		"\t--transport=<libusb|hidraw> : how to reach HalfKay (default libusb)\n"
+		"\t--shared-image : share the parsed image with concurrent processes\n"
+		"\t--low-memory : build packets from an index of the hex file, not an image\n"
+		"\t--realtime : lock memory, raise priority and pin near the xhci irq\n"
+		"\t--timings=json : print phase timings and resource usage as json\n"
+		"\t--events=fd:N : write ndjson progress events to file descriptor N\n"
+		"\t--metrics=<file.prom> : update prometheus textfile metrics on exit\n"
+		"\t--status : publish live progress on the shared-memory status page\n"
+		"\t--status-watch=<ms> : print the status page every ms (0: once)\n"
+		"\t--health : report per-board latency drift from the health database\n"
+		"\t--health-db=<path|off> : health database location\n"
+		"\nUse `teensy-loader --list-mcus` to list supported mcus.\n"
+		);
 	exit(1);
 }
 
@@ -489,37 +2160,56 @@ void die(const char *str, ...) {
 	exit(1);
 }
 
+void die_cause(const char *cause, const char *str, ...) {
+	va_list  ap;
+
+	log_ring_stop();	// flush pending progress before the error event
+	timings.error_cause = cause;
+	event_emit("error", ",\"cause\":\"%s\"", cause);
+	va_start(ap, str);
+	vfprintf(stderr, str, ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
 
+/*
+*  erase_ms is the expected first block (chip erase) time and block_us the
+*  expected time per further block, used by --dry-run. they are coarse
+*  defaults; calibrate them against --timings=json on real hardware.
+*/
 static const struct {
 	const char *name;
 	int32_t code_size;
 	int32_t block_size;
+	int32_t erase_ms;
+	int32_t block_us;
 } MCUs[] = {
 	/* raw board names */
-	{"at90usb162",   15872,   128},
-	{"atmega32u4",   32256,   128},
-	{"at90usb646",   64512,   256},
-	{"at90usb1286", 130048,   256},
-	{"mkl26z64",     63488,   512},
-	{"mk20dx128",   131072,  1024},
-	{"mk20dx256",   262144,  1024},
-	{"mk66fx1m0",  1048576,  1024},
-	{"mk64fx512",   524288,  1024},
-	{"imxrt1062",  2031616,  1024},
+	{"at90usb162",   15872,   128,   10,  9000},
+	{"atmega32u4",   32256,   128,   10,  9000},
+	{"at90usb646",   64512,   256,   15, 12000},
+	{"at90usb1286", 130048,   256,   15, 12000},
+	{"mkl26z64",     63488,   512,  100,  9000},
+	{"mk20dx128",   131072,  1024,  150,  3000},
+	{"mk20dx256",   262144,  1024,  250,  3000},
+	{"mk66fx1m0",  1048576,  1024,  500,  4000},
+	{"mk64fx512",   524288,  1024,  400,  4000},
+	{"imxrt1062",  2031616,  1024,  250, 12000},
 
 	/* pretty board names (duplicates) */
-	{"TEENSY2",     32256,   128},
-	{"TEENSY2PP",  130048,   256},
-	{"TEENSYLC",    63488,   512},
-	{"TEENSY30",   131072,  1024},
-	{"TEENSY31",   262144,  1024},
-	{"TEENSY32",   262144,  1024},
-	{"TEENSY35",   524288,  1024},
-	{"TEENSY36",  1048576,  1024},
-	{"TEENSY40",  2031616,  1024},
-	{"TEENSY41",  8126464,  1024},
-	{"TEENSY_MICROMOD", 16515072,  1024},
-	{NULL, 0, 0},
+	{"TEENSY2",     32256,   128,   10,  9000},
+	{"TEENSY2PP",  130048,   256,   15, 12000},
+	{"TEENSYLC",    63488,   512,  100,  9000},
+	{"TEENSY30",   131072,  1024,  150,  3000},
+	{"TEENSY31",   262144,  1024,  250,  3000},
+	{"TEENSY32",   262144,  1024,  250,  3000},
+	{"TEENSY35",   524288,  1024,  400,  4000},
+	{"TEENSY36",  1048576,  1024,  500,  4000},
+	{"TEENSY40",  2031616,  1024,  250, 12000},
+	{"TEENSY41",  8126464,  1024,  250, 12000},
+	{"TEENSY_MICROMOD", 16515072,  1024,  250, 12000},
+	{NULL, 0, 0, 0, 0},
 };
 
 
@@ -539,8 +2229,11 @@ void read_mcu(char *name) {
 
 	for (int32_t i = 0; MCUs[i].name != NULL; i++) {
 		if (!strcasecmp(name, MCUs[i].name)) {
+			mcu_name   = MCUs[i].name;
 			code_size  = MCUs[i].code_size;
 			block_size = MCUs[i].block_size;
+			erase_ms   = MCUs[i].erase_ms;
+			block_us   = MCUs[i].block_us;
 			return;
 		}
 	}
@@ -566,9 +2259,24 @@ void parse_flag(char *arg) {
 }
 
 
+/* a long option without a value: hand back the argument taken as its value, reject --name=value */
+bool flag_option(const char *name, const char *val, char **argv, int32_t *i) {
+	char err[96];
+
+	if (val != argv[*i]) {
+		snprintf(err, sizeof(err), "--%s takes no value", name);
+		usage(err);
+	}
+	(*i)--;
+	return true;
+}
+
+
 void parse_options(int32_t argc, char **argv) {
 	char *arg;
 
+	if (!(input_files = calloc(argc, sizeof(char *)))) die("out of memory");
+
 	for (int32_t i = 1; i < argc; i++) {
 		arg = argv[i];
 
@@ -586,6 +2294,60 @@ void parse_options(int32_t argc, char **argv) {
 				if(!strcasecmp(name, "help")) usage(NULL);
 				else if(!strcasecmp(name, "mcu")) read_mcu(val);
 				else if(!strcasecmp(name, "list-mcus")) list_mcus();
+				else if(!strcasecmp(name, "timings")) {
+					if (val == NULL || strcasecmp(val, "json"))
+						usage("only --timings=json is supported");
+					timings_json = true;
+				}
+				else if(!strcasecmp(name, "events")) events_open(val);
+				else if(!strcasecmp(name, "health")) health_report_only = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "health-db")) health_db = val;
+				else if(!strcasecmp(name, "status")) status_page = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "status-watch")) {
+					if (val == NULL || (status_watch_ms = atoi(val)) < 0)
+						usage("--status-watch needs an interval in ms");
+				}
+				else if(!strcasecmp(name, "metrics")) metrics_path = val;
+				else if(!strcasecmp(name, "realtime")) realtime = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "diff")) diff_base = val;
+				else if(!strcasecmp(name, "normalize")) normalize_path = val;
+				else if(!strcasecmp(name, "drop-blank")) drop_blank = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "sync-boot")) {
+					if (val == NULL || (sync_boot_count = atoi(val)) < 1 || sync_boot_count > SYNC_BOOT_MAX)
+						usage("--sync-boot needs a board count");
+					boot_only = true;
+				}
+				else if(!strcasecmp(name, "worker")) {
+					if (val == NULL || (worker_port = atoi(val)) <= 0 || worker_port > 65535)
+						usage("--worker needs a tcp port");
+				}
+				else if(!strcasecmp(name, "listen")) {
+					char *port = val ? strrchr(val, ':') : NULL;
+					if (port == NULL || port == val || (worker_port = atoi(port + 1)) <= 0 || worker_port > 65535)
+						usage("--listen needs host:port");
+					*port = '\0';
+					if (val[0] == '[' && port[-1] == ']') {	// [ipv6]:port
+						port[-1] = '\0';
+						val++;
+					}
+					worker_host = val;
+				}
+				else if(!strcasecmp(name, "coordinator")) coordinator = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "station")) {
+					if (val == NULL) usage("--station needs host:port or local");
+					if (station_count == FARM_MAX_STATIONS) usage("too many stations");
+					stations[station_count++] = val;
+				}
+				else if(!strcasecmp(name, "shared-image")) shared_image = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "transport")) {
+					if (val && !strcasecmp(val, "hidraw")) hidraw_transport = true;
+					else if (val && !strcasecmp(val, "libusb")) hidraw_transport = false;
+					else usage("--transport must be libusb or hidraw");
+				}
+				else if(!strcasecmp(name, "low-memory")) low_memory = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "validate")) validate = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "watch")) watch = flag_option(name, val, argv, &i);
+				else if(!strcasecmp(name, "dry-run")) dry_run = flag_option(name, val, argv, &i);
 				else {
 					fprintf(stderr, "unknown option \"%s\"\n\n", arg);
 					usage(NULL);
@@ -593,7 +2355,10 @@ void parse_options(int32_t argc, char **argv) {
 			}
 			else parse_flag(arg);
 		}
-		else filename = arg;
+		else {
+			filename = arg;
+			input_files[input_count++] = arg;
+		}
 	}
 }
 
@@ -605,3 +2370,1924 @@ void teensy_boot(uint8_t *buf, int32_t write_size) {
 	buf[2] = 0xFF;
 	teensy_write(buf, write_size, 0.5);
 }
+
+
+/****************************/
+/*    Synchronized Boot    */
+/****************************/
+
+/*
+*  --sync-boot=N opens N boards waiting in HalfKay (flashed earlier with -n),
+*  prepares a boot packet per board and gives each its own thread. the
+*  threads meet at a barrier and then spin on a flag, so the main thread can
+*  release them together without N futex wake-ups spreading the start times.
+*  with more boards than spare cpus they yield while spinning instead.
+*/
+struct sync_board {
+	pthread_t thread;
+	int32_t	 index;
+	int32_t	 write_size;
+	uint8_t	 buf[1088];
+	uint64_t start_ns, end_ns;
+	int32_t	 ok;
+};
+
+static pthread_barrier_t sync_barrier;
+static atomic_bool	 sync_go;
+static bool		 sync_yield;
+
+static void *sync_boot_thread(void *arg) {
+	struct sync_board *b = arg;
+
+	pthread_barrier_wait(&sync_barrier);
+	while (!atomic_load_explicit(&sync_go, memory_order_acquire)) {
+		if (sync_yield) sched_yield();
+	}
+	b->start_ns = monotonic_ns();
+	b->ok = teensy_write_to(b->index, b->buf, b->write_size, 0.5);
+	b->end_ns = monotonic_ns();
+	return NULL;
+}
+
+void sync_boot(int32_t count, int32_t write_size) {
+	struct sync_board *boards;
+	uint64_t t, start_min = UINT64_MAX, start_max = 0, end_min = UINT64_MAX, end_max = 0;
+	int32_t n, failed = 0;
+	bool waited = false;
+
+	t = timing_begin(PHASE_OPEN);
+	while ((n = teensy_open_all(count)) < count) {
+		timings.open_attempts++;
+		if (!wait_for_device_to_appear)
+			die_cause("no_device", "found %d of %d HalfKay boards (try -w option)\n", n, count);
+		if (!waited) {
+			printf_verbose("waiting for %d teensy devices...\n", count);
+			waited = true;
+		}
+		usleep(250000);
+	}
+	timing_add(PHASE_OPEN, t);
+	printf_verbose("found %d HalfKay bootloaders\n", n);
+
+	if (!(boards = calloc(count, sizeof(*boards)))) die("out of memory");
+	sync_yield = count >= sysconf(_SC_NPROCESSORS_ONLN);
+	atomic_store(&sync_go, false);
+	pthread_barrier_init(&sync_barrier, NULL, count + 1);
+	for (int32_t i = 0; i < count; i++) {
+		boards[i].index = i;
+		boards[i].write_size = write_size;
+		boards[i].buf[0] = 0xFF;	// same packet as teensy_boot
+		boards[i].buf[1] = 0xFF;
+		boards[i].buf[2] = 0xFF;
+		if (pthread_create(&boards[i].thread, NULL, sync_boot_thread, &boards[i]))
+			die("unable to start boot thread");
+	}
+	pthread_barrier_wait(&sync_barrier);
+	printf_verbose("booting %d boards...\n", count);
+	t = timing_begin(PHASE_BOOT);
+	atomic_store_explicit(&sync_go, true, memory_order_release);
+	for (int32_t i = 0; i < count; i++) {
+		pthread_join(boards[i].thread, NULL);
+		if (!boards[i].ok) failed++;
+		if (boards[i].start_ns < start_min) start_min = boards[i].start_ns;
+		if (boards[i].start_ns > start_max) start_max = boards[i].start_ns;
+		if (boards[i].end_ns < end_min) end_min = boards[i].end_ns;
+		if (boards[i].end_ns > end_max) end_max = boards[i].end_ns;
+	}
+	timing_add(PHASE_BOOT, t);
+	pthread_barrier_destroy(&sync_barrier);
+	teensy_close_all();
+
+	for (int32_t i = 0; i < count; i++) {
+		printf_verbose("board %d: %s, issued +%.1f us, done +%.1f us\n", i, boards[i].ok ? "ok" : "failed",
+			(boards[i].start_ns - start_min) / 1e3, (boards[i].end_ns - end_min) / 1e3);
+	}
+	printf("booted %d of %d boards: start skew %.1f us, completion skew %.1f us\n",
+		count - failed, count, (start_max - start_min) / 1e3, (end_max - end_min) / 1e3);
+	event_emit("boot", ",\"boards\":%d,\"failed\":%d,\"start_skew_us\":%.1f,\"done_skew_us\":%.1f",
+		count, failed, (start_max - start_min) / 1e3, (end_max - end_min) / 1e3);
+	free(boards);
+	if (failed) die_cause("boot_failed", "%d boards did not accept the boot request", failed);
+}
+
+
+/********************************/
+/*    Timing & Resource Report   */
+/********************************/
+
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* start of a phase: publishes it on the status page, returns the start time */
+uint64_t timing_begin(enum timing_phase phase) {
+	status_phase(phase);
+	return monotonic_ns();
+}
+
+uint64_t timing_add(enum timing_phase phase, uint64_t start_ns) {
+	uint64_t elapsed = monotonic_ns() - start_ns;
+
+	timings.phase_ns[phase] += elapsed;
+	timings.phase_calls[phase]++;
+	return elapsed;
+}
+
+/* private (anonymous) resident memory, which unlike ru_maxrss leaves out mapped files */
+static long rss_anon_kb(void) {
+	char line[128];
+	long kb = -1;
+	FILE *fp = fopen("/proc/self/status", "r");
+
+	if (!fp) return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "RssAnon: %ld", &kb) == 1) break;
+	}
+	fclose(fp);
+	return kb;
+}
+
+void timings_print_json(void) {
+	struct rusage ru;
+	uint64_t xfer_ns;
+	double throughput = 0.0;
+
+	if (timings.idle) return;
+	getrusage(RUSAGE_SELF, &ru);
+	xfer_ns = timings.phase_ns[PHASE_ERASE] + timings.phase_ns[PHASE_WRITE];
+	if (xfer_ns) throughput = (double) timings.bytes_written / ((double) xfer_ns / 1e9);
+
+	printf("{\"result\":\"%s\",\"mcu\":\"%s\",\"transport\":\"%s\",\"total_s\":%.6f,\"phases\":{",
+		timings.success ? "ok" : "error", mcu_name ? mcu_name : "", hidraw_transport ? "hidraw" : "libusb",
+		(double)(monotonic_ns() - timings.start_ns) / 1e9);
+	for (int32_t i = 0; i < PHASE_COUNT; i++) {
+		printf("%s\"%s\":{\"s\":%.6f,\"calls\":%d}", i ? "," : "", timing_phase_names[i],
+			(double) timings.phase_ns[i] / 1e9, timings.phase_calls[i]);
+	}
+	printf("},\"blocks_written\":%d,\"bytes_written\":%lld,\"throughput_Bps\":%.1f,"
+		"\"block_max_s\":%.6f,\"write_retries\":%d,\"open_attempts\":%d,\"open_to_transfer_s\":%.6f,"
+		"\"permission_wait_s\":%.6f,"
+		"\"gap_mean_us\":%.1f,\"gap_stddev_us\":%.1f,\"gap_max_us\":%.1f,"
+		"\"peak_rss_kb\":%ld,\"rss_anon_kb\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld}\n",
+		timings.blocks_written, (long long) timings.bytes_written, throughput,
+		(double) timings.block_max_ns / 1e9, timings.write_retries, timings.open_attempts,
+		(double) timings.open_to_transfer_ns / 1e9, (double) timings.permission_wait_ns / 1e9,
+		timings.gap_mean_ns / 1e3, timings.gap_count > 1 ? sqrt(timings.gap_m2 / (timings.gap_count - 1)) / 1e3 : 0.0,
+		(double) timings.gap_max_ns / 1e3,
+		ru.ru_maxrss, rss_anon_kb(), ru.ru_minflt, ru.ru_majflt);
+	fflush(stdout);
+}
+
+
+/***************************/
+/*    NDJSON Event Stream    */
+/***************************/
+
+/*
+*  events are formatted into a fixed buffer and written at phase boundaries
+*  (or when the buffer fills) without ever blocking, so a slow reader can
+*  never stall the usb write loop. a pipe or tty is reopened through
+*  /proc/self/fd as a new open file description in O_NONBLOCK mode, leaving
+*  the flags of the one it came from alone (fd:1 shares its description with
+*  stdout); a socket is written with MSG_DONTWAIT, and a regular file, which
+*  has no reader to wait for, as it is. events that do not fit while the
+*  reader is behind are dropped and counted; the final flush at exit waits a
+*  bounded time for the reader.
+*/
+#define EVENT_BUFFER_SIZE	8192
+#define EVENT_BLOCK_INTERVAL_NS	100000000ull	// at most 10 block events per second
+#define EVENT_FINAL_FLUSH_MS	1000
+
+static int32_t	event_fd = -1;
+static bool	event_socket = false;		// send() with MSG_DONTWAIT
+static char	event_buf[EVENT_BUFFER_SIZE];
+static int32_t	event_len = 0;
+static int32_t	events_dropped = 0;
+static uint64_t	event_last_block_ns = 0;
+
+void events_open(const char *spec) {
+	char *end, path[64];
+	struct stat st;
+	long fd;
+
+	if (spec == NULL || strncmp(spec, "fd:", 3)) usage("--events expects fd:N");
+	fd = strtol(spec + 3, &end, 10);
+	if (*end != '\0' || end == spec + 3 || fd < 0) usage("--events expects fd:N");
+	if (fstat((int) fd, &st) < 0) die("--events: file descriptor %ld is not open", fd);
+	if (S_ISSOCK(st.st_mode) || S_ISREG(st.st_mode)) {
+		event_socket = S_ISSOCK(st.st_mode);
+		event_fd = (int32_t) fd;
+		return;
+	}
+	snprintf(path, sizeof(path), "/proc/self/fd/%ld", fd);
+	if ((event_fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		die("--events: unable to reopen file descriptor %ld without blocking: %s", fd, strerror(errno));
+}
+
+// write what the reader will take, waiting at most timeout_ms for it
+static void events_write(int32_t timeout_ms) {
+	struct pollfd pfd = { .fd = event_fd, .events = POLLOUT };
+	uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+	uint64_t now;
+	ssize_t r;
+	int32_t off = 0;
+
+	while (event_fd >= 0 && off < event_len) {
+		if (event_socket) r = send(event_fd, event_buf + off, event_len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		else r = write(event_fd, event_buf + off, event_len - off);
+		if (r > 0) {
+			off += r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR) continue;
+		if (r == 0 || errno != EAGAIN) break;			// reader gone
+		if ((now = monotonic_ns()) >= deadline) break;		// reader is behind
+		if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) < 0 && errno != EINTR) break;
+	}
+	memmove(event_buf, event_buf + off, event_len - off);
+	event_len -= off;
+}
+
+void events_flush(void) {
+	events_write(0);
+}
+
+void events_finish(void) {
+	events_write(EVENT_FINAL_FLUSH_MS);
+	if (event_fd >= 0 && event_len > 0)
+		fprintf(stderr, "--events: reader did not take the last %d bytes\n", event_len);
+}
+
+static void event_vemit(uint64_t t_ns, const char *name, const char *fields, va_list ap) {
+	char line[512];
+	int32_t n, m;
+
+	if (event_fd < 0) return;
+	n = snprintf(line, sizeof(line), "{\"t\":%.6f,\"event\":\"%s\"",
+		(double)(t_ns - timings.start_ns) / 1e9, name);
+	m = vsnprintf(line + n, sizeof(line) - n, fields, ap);
+	if (m < 0 || n + m >= (int32_t) sizeof(line) - 24) return;
+	n += m;
+	if (events_dropped)
+		n += snprintf(line + n, sizeof(line) - n, ",\"dropped\":%d", events_dropped);
+	n += snprintf(line + n, sizeof(line) - n, "}\n");
+
+	if (event_len + n > EVENT_BUFFER_SIZE) events_flush();
+	if (event_len + n > EVENT_BUFFER_SIZE) {
+		events_dropped++;
+		return;
+	}
+	memcpy(event_buf + event_len, line, n);
+	event_len += n;
+	if (strcmp(name, "block")) events_flush();	// phase boundary
+}
+
+void event_emit(const char *name, const char *fields, ...) {
+	va_list ap;
+
+	va_start(ap, fields);
+	event_vemit(monotonic_ns(), name, fields, ap);
+	va_end(ap);
+}
+
+void event_emit_at(uint64_t t_ns, const char *name, const char *fields, ...) {
+	va_list ap;
+
+	va_start(ap, fields);
+	event_vemit(t_ns, name, fields, ap);
+	va_end(ap);
+}
+
+void event_block(uint64_t t_ns, int32_t n, int32_t total, int32_t addr, uint64_t latency_ns) {
+	if (event_fd < 0) return;
+	if (n != 1 && n != total && t_ns - event_last_block_ns < EVENT_BLOCK_INTERVAL_NS) return;
+	event_last_block_ns = t_ns;
+	event_emit_at(t_ns, "block", ",\"n\":%d,\"of\":%d,\"addr\":%d,\"bytes\":%d,\"latency_us\":%llu",
+		n, total, addr, block_size, (unsigned long long)(latency_ns / 1000));
+	if (event_len > EVENT_BUFFER_SIZE / 2) events_flush();
+}
+
+
+/*********************************/
+/*    Log Ring (USB Hot Path)    */
+/*********************************/
+
+/*
+*  the block loop only pushes fixed-size records into a preallocated
+*  single-producer single-consumer ring; a consumer thread turns them into
+*  verbose output and events, so terminal or pipe speed never stretches the
+*  gaps between usb transfers. if the ring is full records are dropped.
+*/
+#define LOG_RING_SIZE	1024		// must be a power of two
+
+struct log_record {
+	uint64_t t_ns;
+	uint64_t latency_ns;
+	int32_t	 n, total, addr;
+};
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static atomic_uint	log_head = 0;		// written by the producer only
+static atomic_uint	log_tail = 0;		// written by the consumer only
+static atomic_bool	log_running = false;
+static bool		log_active = false;
+static uint32_t		log_dropped = 0;
+static pthread_t	log_thread;
+
+static void log_format(const struct log_record *rec) {
+	if (rec->n == 1)
+		event_emit_at(rec->t_ns, "erase_done", ",\"latency_us\":%llu",
+			(unsigned long long)(rec->latency_ns / 1000));
+	printf_verbose("- addr: %d\n", rec->addr);
+	event_block(rec->t_ns, rec->n, rec->total, rec->addr, rec->latency_ns);
+}
+
+static void log_drain(void) {
+	uint32_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&log_head, memory_order_acquire);
+
+	while (tail != head) {
+		log_format(&log_ring[tail & (LOG_RING_SIZE - 1)]);
+		tail++;
+		atomic_store_explicit(&log_tail, tail, memory_order_release);
+	}
+}
+
+static void *log_consumer(void *arg) {
+	struct timespec ts = {0, 2000000};	// 2ms between drains
+
+	(void) arg;
+	while (atomic_load_explicit(&log_running, memory_order_acquire)) {
+		log_drain();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+void log_ring_start(void) {
+	struct sched_param sp = { .sched_priority = 0 };
+	pthread_attr_t attr;
+
+	if (log_active || (!verbose && event_fd < 0)) return;
+	fflush(stdout);
+	atomic_store(&log_running, true);
+	pthread_attr_init(&attr);	// never inherit --realtime scheduling from the transfer thread
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &sp);
+	if (pthread_create(&log_thread, &attr, log_consumer, NULL)) {
+		atomic_store(&log_running, false);	// no thread, drain at log_ring_stop() instead
+	}
+	pthread_attr_destroy(&attr);
+	log_active = true;
+}
+
+void log_ring_stop(void) {
+	if (!log_active) return;
+	if (atomic_exchange(&log_running, false))
+		pthread_join(log_thread, NULL);
+	log_drain();
+	log_active = false;
+	if (log_dropped) printf_verbose("(%u progress records dropped)\n", log_dropped);
+	log_dropped = 0;
+}
+
+void log_block(int32_t n, int32_t total, int32_t addr, uint64_t latency_ns) {
+	uint32_t head, tail;
+	struct log_record *rec;
+
+	if (!log_active) return;
+	head = atomic_load_explicit(&log_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&log_tail, memory_order_acquire);
+	if (head - tail >= LOG_RING_SIZE) {
+		log_dropped++;
+		return;
+	}
+	rec = &log_ring[head & (LOG_RING_SIZE - 1)];
+	rec->t_ns = monotonic_ns();
+	rec->latency_ns = latency_ns;
+	rec->n = n;
+	rec->total = total;
+	rec->addr = addr;
+	atomic_store_explicit(&log_head, head + 1, memory_order_release);
+}
+
+
+/*****************************************/
+/*    Per-Board Latency Health Database    */
+/*****************************************/
+
+/*
+*  log-linear (HDR-style) histograms of per-block write latency, first block
+*  erase time and reboot-to-HalfKay latency, in microseconds, keyed by usb
+*  serial and port path. one text line per board and metric:
+*
+*    <serial> <port> <metric> <runs> <recent p50s, oldest first> <bucket:count,...>
+*
+*  a board is flagged when the median of its recent runs drifts above the
+*  long-term p90 (or 1.5x the long-term median).
+*/
+#define HEALTH_RECENT		8	// recent per-run medians kept per metric
+#define HEALTH_MIN_RUNS		5	// runs needed before drift is reported
+#define HEALTH_MAX_ENTRIES	1024
+
+static const char *health_metric_names[HEALTH_COUNT] = { "block", "erase", "reboot" };
+
+struct health_entry {
+	char	 serial[64];
+	char	 port[64];
+	int32_t	 metric;
+	uint32_t runs;
+	uint32_t nrecent;
+	uint64_t recent[HEALTH_RECENT];
+	struct histogram hist;
+};
+
+static int32_t hist_bucket(uint64_t v) {
+	int32_t e;
+
+	if (v < (1u << HIST_SUB_BITS)) return (int32_t) v;
+	e = 63 - __builtin_clzll(v);
+	if (e > 40) return HIST_BUCKETS - 1;
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int32_t)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_value(int32_t bucket) {
+	int32_t e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+
+	if (bucket < (1 << HIST_SUB_BITS)) return (uint64_t) bucket;
+	return ((1ull << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
+}
+
+void hist_record(struct histogram *h, uint64_t value_us) {
+	int32_t b = hist_bucket(value_us);
+
+	if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+	h->buckets[b]++;
+	h->count++;
+}
+
+uint64_t hist_percentile(const struct histogram *h, double p) {
+	uint64_t want, seen = 0;
+
+	if (!h->count) return 0;
+	want = (uint64_t)(p * (double) h->count);
+	if (want >= h->count) want = h->count - 1;
+	for (int32_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want) return hist_value(i);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+static const char *health_db_path(void) {
+	static char path[512];
+	const char *base;
+
+	if (health_db) return strcasecmp(health_db, "off") ? health_db : NULL;
+	if ((base = getenv("XDG_STATE_HOME")) && *base) {
+		snprintf(path, sizeof(path), "%s/teensy-loader", base);
+	} else if ((base = getenv("HOME")) && *base) {
+		snprintf(path, sizeof(path), "%s/.local", base);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/.local/state", base);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/.local/state/teensy-loader", base);
+	} else {
+		return NULL;
+	}
+	mkdir(path, 0755);
+	strncat(path, "/health.db", sizeof(path) - strlen(path) - 1);
+	return path;
+}
+
+static int32_t health_load(FILE *fp, struct health_entry *entries, int32_t max) {
+	char line[8192], metric[16], *p, *tok;
+	int32_t n = 0, off;
+	struct health_entry *e;
+
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		e = &entries[n];
+		memset(e, 0, sizeof(*e));
+		if (sscanf(line, "%63s %63s %15s %u%n", e->serial, e->port, metric, &e->runs, &off) != 4) continue;
+		for (e->metric = 0; e->metric < HEALTH_COUNT; e->metric++)
+			if (!strcmp(metric, health_metric_names[e->metric])) break;
+		if (e->metric == HEALTH_COUNT) continue;
+		p = line + off;
+		while (*p == ' ') p++;
+		tok = strsep(&p, " ");
+		for (char *v = strtok(tok, ","); v && e->nrecent < HEALTH_RECENT; v = strtok(NULL, ","))
+			if (*v != '-') e->recent[e->nrecent++] = strtoull(v, NULL, 10);
+		for (tok = p ? strtok(p, ",\n") : NULL; tok; tok = strtok(NULL, ",\n")) {
+			int32_t b;
+			uint32_t c;
+			if (sscanf(tok, "%d:%u", &b, &c) != 2 || b < 0 || b >= HIST_BUCKETS) continue;
+			e->hist.buckets[b] += c;
+			e->hist.count += c;
+		}
+		n++;
+	}
+	return n;
+}
+
+static void health_save(FILE *fp, const struct health_entry *entries, int32_t n) {
+	for (int32_t i = 0; i < n; i++) {
+		const struct health_entry *e = &entries[i];
+		fprintf(fp, "%s %s %s %u ", e->serial, e->port, health_metric_names[e->metric], e->runs);
+		if (!e->nrecent) fputc('-', fp);
+		for (uint32_t r = 0; r < e->nrecent; r++) fprintf(fp, "%s%llu", r ? "," : "", (unsigned long long) e->recent[r]);
+		fputc(' ', fp);
+		for (int32_t b = 0, first = 1; b < HIST_BUCKETS; b++) {
+			if (!e->hist.buckets[b]) continue;
+			fprintf(fp, "%s%d:%u", first ? "" : ",", b, e->hist.buckets[b]);
+			first = 0;
+		}
+		fputc('\n', fp);
+	}
+}
+
+void health_update(void) {
+	static struct health_entry entries[HEALTH_MAX_ENTRIES];
+	const char *path = health_db_path();
+	char port[64], serial[64], lock_path[600], tmp[600];
+	struct health_entry *e;
+	int32_t n = 0, lock_fd, i;
+	FILE *fp;
+
+	if (!path || !teensy_location(port, sizeof(port), serial, sizeof(serial))) return;
+	for (i = 0; i < (int32_t) sizeof(serial) && serial[i]; i++)	// keep the db whitespace separated
+		if (serial[i] == ' ') serial[i] = '_';
+
+	// lock a file that rename() never replaces, or a waiter would hold a lock on the old db
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+	lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0) return;
+	flock(lock_fd, LOCK_EX);
+	if ((fp = fopen(path, "r"))) {
+		n = health_load(fp, entries, HEALTH_MAX_ENTRIES);
+		fclose(fp);
+	}
+
+	for (int32_t m = 0; m < HEALTH_COUNT; m++) {
+		if (!run_hist[m].count) continue;
+		for (i = 0; i < n; i++)
+			if (entries[i].metric == m && !strcmp(entries[i].serial, serial) && !strcmp(entries[i].port, port)) break;
+		if (i == n) {
+			if (n == HEALTH_MAX_ENTRIES) continue;
+			e = &entries[n++];
+			memset(e, 0, sizeof(*e));
+			snprintf(e->serial, sizeof(e->serial), "%s", serial);
+			snprintf(e->port, sizeof(e->port), "%s", port);
+			e->metric = m;
+		}
+		e = &entries[i];
+		for (int32_t b = 0; b < HIST_BUCKETS; b++) e->hist.buckets[b] += run_hist[m].buckets[b];
+		e->hist.count += run_hist[m].count;
+		e->runs++;
+		if (e->nrecent == HEALTH_RECENT) {
+			memmove(e->recent, e->recent + 1, sizeof(e->recent[0]) * (HEALTH_RECENT - 1));
+			e->nrecent--;
+		}
+		e->recent[e->nrecent++] = hist_percentile(&run_hist[m], 0.5);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+	if ((fp = fopen(tmp, "w"))) {
+		health_save(fp, entries, n);
+		if (fclose(fp) == 0) rename(tmp, path);
+		else unlink(tmp);
+	}
+	close(lock_fd);
+	printf_verbose("updated health database \"%s\" for %s (%s)\n", path, port, serial);
+}
+
+void health_report(void) {
+	static struct health_entry entries[HEALTH_MAX_ENTRIES];
+	const char *path = health_db_path();
+	uint64_t p50, p90, recent;
+	int32_t n, flagged = 0;
+	FILE *fp;
+
+	if (!path || !(fp = fopen(path, "r"))) die("no health database found");
+	n = health_load(fp, entries, HEALTH_MAX_ENTRIES);
+	fclose(fp);
+
+	printf("%-20s %-12s %-7s %5s %9s %9s %9s %9s  %s\n",
+		"serial", "port", "metric", "runs", "p50_us", "p90_us", "p99_us", "recent", "status");
+	for (int32_t i = 0; i < n; i++) {
+		struct health_entry *e = &entries[i];
+		uint64_t sorted[HEALTH_RECENT];
+		const char *status = "ok";
+
+		p50 = hist_percentile(&e->hist, 0.5);
+		p90 = hist_percentile(&e->hist, 0.9);
+		memcpy(sorted, e->recent, sizeof(sorted));
+		for (uint32_t a = 1; a < e->nrecent; a++)	// median of the recent per-run medians
+			for (uint32_t b = a; b > 0 && sorted[b - 1] > sorted[b]; b--) {
+				uint64_t x = sorted[b]; sorted[b] = sorted[b - 1]; sorted[b - 1] = x;
+			}
+		recent = e->nrecent ? sorted[e->nrecent / 2] : 0;
+		if (e->runs < HEALTH_MIN_RUNS) {
+			status = "learning";
+		} else if (recent > p90 || recent * 2 > p50 * 3) {
+			status = "DRIFT";
+			flagged++;
+		}
+		printf("%-20s %-12s %-7s %5u %9llu %9llu %9llu %9llu  %s\n",
+			e->serial, e->port, health_metric_names[e->metric], e->runs,
+			(unsigned long long) p50, (unsigned long long) p90,
+			(unsigned long long) hist_percentile(&e->hist, 0.99),
+			(unsigned long long) recent, status);
+	}
+	if (flagged) printf("\n%d board/metric pair(s) drifting: check cables, hubs and flash wear\n", flagged);
+}
+
+
+/***************************************/
+/*    Prometheus Textfile Exporter    */
+/***************************************/
+
+/*
+*  counters survive across runs by re-reading the previous textfile; the
+*  update happens under an exclusive lock and lands with rename() so
+*  node_exporter never sees a partial file.
+*/
+#define METRICS_MAX_SAMPLES	1024
+
+struct metric_sample {
+	char	name[64];
+	char	labels[128];
+	double	value;
+};
+
+static const struct {
+	const char *name, *type, *help;
+} metric_families[] = {
+	{"teensy_loader_flashes_total",			"counter",	"Flash runs by result and mcu."},
+	{"teensy_loader_bytes_programmed_total",	"counter",	"Bytes of flash programmed."},
+	{"teensy_loader_blocks_programmed_total",	"counter",	"Flash blocks programmed."},
+	{"teensy_loader_write_retries_total",		"counter",	"Retried block transfers."},
+	{"teensy_loader_timeouts_total",		"counter",	"Runs aborted by an erase or write timeout."},
+	{"teensy_loader_reboots_total",			"counter",	"Reboot requests by method and whether HalfKay appeared."},
+	{"teensy_loader_phase_duration_seconds",	"histogram",	"Time spent per phase of a flash run."},
+	{"teensy_loader_last_run_timestamp_seconds",	"gauge",	"Unix time of the last run."},
+	{NULL, NULL, NULL},
+};
+
+static const double metric_phase_buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 };
+
+static struct metric_sample metric_samples[METRICS_MAX_SAMPLES];
+static int32_t metric_count = 0;
+
+static struct metric_sample *metric_get(const char *name, const char *labels) {
+	struct metric_sample *m;
+
+	for (int32_t i = 0; i < metric_count; i++)
+		if (!strcmp(metric_samples[i].name, name) && !strcmp(metric_samples[i].labels, labels))
+			return &metric_samples[i];
+	if (metric_count == METRICS_MAX_SAMPLES) return NULL;
+	m = &metric_samples[metric_count++];
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	snprintf(m->labels, sizeof(m->labels), "%s", labels);
+	m->value = 0;
+	return m;
+}
+
+static void metric_add(const char *name, double delta, const char *labels, ...) {
+	char buf[128];
+	struct metric_sample *m;
+	va_list ap;
+
+	va_start(ap, labels);
+	vsnprintf(buf, sizeof(buf), labels, ap);
+	va_end(ap);
+	if ((m = metric_get(name, buf))) m->value += delta;
+}
+
+static void metric_observe(const char *name, double v, const char *labels) {
+	char buf[160], le[32];
+	int32_t i;
+
+	for (i = 0; i < (int32_t)(sizeof(metric_phase_buckets) / sizeof(metric_phase_buckets[0])); i++) {
+		snprintf(le, sizeof(le), "%g", metric_phase_buckets[i]);
+		snprintf(buf, sizeof(buf), "%s_bucket", name);
+		metric_add(buf, v <= metric_phase_buckets[i] ? 1 : 0, "%s,le=\"%s\"", labels, le);
+	}
+	snprintf(buf, sizeof(buf), "%s_bucket", name);
+	metric_add(buf, 1, "%s,le=\"+Inf\"", labels);
+	snprintf(buf, sizeof(buf), "%s_sum", name);
+	metric_add(buf, v, "%s", labels);
+	snprintf(buf, sizeof(buf), "%s_count", name);
+	metric_add(buf, 1, "%s", labels);
+}
+
+static void metrics_load(FILE *fp) {
+	char line[512], name[64], labels[128];
+	double value;
+	char *brace;
+
+	metric_count = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n') continue;
+		labels[0] = '\0';
+		if ((brace = strchr(line, '{'))) {
+			if (sscanf(brace, "{%127[^}]} %lf", labels, &value) != 2) continue;
+			*brace = '\0';
+			snprintf(name, sizeof(name), "%.63s", line);
+		} else if (sscanf(line, "%63s %lf", name, &value) != 2) {
+			continue;
+		}
+		if (!strcmp(name, "teensy_loader_last_run_timestamp_seconds")) continue;
+		metric_add(name, value, "%s", labels);
+	}
+}
+
+static void metrics_save(FILE *fp) {
+	size_t len;
+
+	for (int32_t f = 0; metric_families[f].name; f++) {
+		len = strlen(metric_families[f].name);
+		fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", metric_families[f].name,
+			metric_families[f].help, metric_families[f].name, metric_families[f].type);
+		for (int32_t i = 0; i < metric_count; i++) {
+			const struct metric_sample *m = &metric_samples[i];
+			if (strncmp(m->name, metric_families[f].name, len)) continue;
+			if (m->name[len] && strcmp(m->name + len, "_bucket") && strcmp(m->name + len, "_sum")
+			   && strcmp(m->name + len, "_count")) continue;
+			if (m->labels[0]) fprintf(fp, "%s{%s} %.15g\n", m->name, m->labels, m->value);
+			else fprintf(fp, "%s %.15g\n", m->name, m->value);
+		}
+	}
+}
+
+void metrics_write(void) {
+	const char *mcu = mcu_name ? mcu_name : "unknown";
+	const char *result = timings.success ? "ok" : (timings.error_cause ? timings.error_cause : "error");
+	char lock_path[512], tmp[512], labels[96];
+	int32_t lock_fd;
+	FILE *fp;
+
+	if (!metrics_path || timings.idle) return;
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", metrics_path);
+	lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0) return;
+	flock(lock_fd, LOCK_EX);
+
+	metric_count = 0;
+	if ((fp = fopen(metrics_path, "r"))) {
+		metrics_load(fp);
+		fclose(fp);
+	}
+	metric_add("teensy_loader_flashes_total", 1, "result=\"%s\",mcu=\"%s\"", result, mcu);
+	metric_add("teensy_loader_bytes_programmed_total", (double) timings.bytes_written, "mcu=\"%s\"", mcu);
+	metric_add("teensy_loader_blocks_programmed_total", timings.blocks_written, "mcu=\"%s\"", mcu);
+	metric_add("teensy_loader_write_retries_total", timings.write_retries, "mcu=\"%s\"", mcu);
+	metric_add("teensy_loader_timeouts_total", 0, "phase=\"erase\",mcu=\"%s\"", mcu);
+	metric_add("teensy_loader_timeouts_total", 0, "phase=\"write\",mcu=\"%s\"", mcu);
+	if (timings.error_cause && !strcmp(timings.error_cause, "erase_timeout"))
+		metric_add("teensy_loader_timeouts_total", 1, "phase=\"erase\",mcu=\"%s\"", mcu);
+	if (timings.error_cause && !strcmp(timings.error_cause, "write_timeout"))
+		metric_add("teensy_loader_timeouts_total", 1, "phase=\"write\",mcu=\"%s\"", mcu);
+	if (timings.reboot_method)
+		metric_add("teensy_loader_reboots_total", 1, "method=\"%s\",result=\"%s\"",
+			timings.reboot_method, timings.reboot_ok ? "success" : "failure");
+	for (int32_t i = 0; i < PHASE_COUNT; i++) {
+		if (!timings.phase_calls[i]) continue;
+		snprintf(labels, sizeof(labels), "phase=\"%s\"", timing_phase_names[i]);
+		metric_observe("teensy_loader_phase_duration_seconds", (double) timings.phase_ns[i] / 1e9, labels);
+	}
+	metric_add("teensy_loader_last_run_timestamp_seconds", (double) time(NULL), "");
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", metrics_path, (int) getpid());
+	if ((fp = fopen(tmp, "w"))) {
+		metrics_save(fp);
+		if (fclose(fp) == 0) rename(tmp, metrics_path);
+		else unlink(tmp);
+	}
+	close(lock_fd);
+}
+
+
+/*****************************/
+/*    Low-Jitter Flashing    */
+/*****************************/
+
+/*
+*  --realtime keeps the transfer thread from being delayed by other load:
+*  the image, plan and packet buffers are locked (and so prefaulted), the
+*  thread runs at SCHED_FIFO (below threaded irq handlers, which default to
+*  50) or failing that at raised nice and io priority, and it is pinned to
+*  the cpu that services the xhci interrupt so wake-ups stay cache-local.
+*/
+#define REALTIME_FIFO_PRIORITY	10
+#define REALTIME_NICE		-10
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_RT		1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_WHO_PROCESS	1
+
+/* the first cpu in the affinity list of an xhci interrupt, or -1 */
+static int32_t xhci_irq_cpu(int32_t *irq_out) {
+	char line[1024], path[64];
+	int32_t irq = -1, cpu = -1;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/interrupts", "r"))) return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strstr(line, "xhci") && sscanf(line, " %d:", &irq) == 1) break;
+		irq = -1;
+	}
+	fclose(fp);
+	if (irq < 0) return -1;
+
+	snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+	if (!(fp = fopen(path, "r"))) {
+		snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+		if (!(fp = fopen(path, "r"))) return -1;
+	}
+	if (fscanf(fp, "%d", &cpu) != 1) cpu = -1;
+	fclose(fp);
+	*irq_out = irq;
+	return cpu;
+}
+
+static size_t lock_range(const void *addr, size_t len) {
+	return mlock(addr, len) == 0 ? len : 0;
+}
+
+void realtime_prepare(uint8_t *buf, size_t buf_len) {
+	struct sched_param sp = { .sched_priority = REALTIME_FIFO_PRIORITY };
+	size_t locked = 0;
+	int32_t cpu, irq = -1;
+	cpu_set_t set;
+
+	if (!low_memory) {	// with --low-memory packets are built from the mapped file
+		locked += lock_range(firmware_image, code_size);
+		locked += lock_range(firmware_mask, code_size);
+	}
+	locked += lock_range(block_plan, sizeof(block_plan[0]) * (code_size / block_size + 1));
+	locked += lock_range(buf, buf_len);
+	locked += lock_range(log_ring, sizeof(log_ring));
+	if (locked) printf_verbose("realtime: locked %.1f MB\n", locked / 1048576.0);
+	else fprintf(stderr, "realtime: unable to lock memory (raise RLIMIT_MEMLOCK)\n");
+
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0) {
+		printf_verbose("realtime: SCHED_FIFO priority %d\n", REALTIME_FIFO_PRIORITY);
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_RT << IOPRIO_CLASS_SHIFT) | 4);
+	} else {
+		if (setpriority(PRIO_PROCESS, 0, REALTIME_NICE) == 0)
+			printf_verbose("realtime: no SCHED_FIFO permission, using nice %d\n", REALTIME_NICE);
+		else
+			fprintf(stderr, "realtime: unable to raise scheduling priority\n");
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 0);
+	}
+
+	if ((cpu = xhci_irq_cpu(&irq)) >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+			printf_verbose("realtime: pinned to cpu %d (xhci irq %d)\n", cpu, irq);
+	}
+}
+
+void realtime_report(void) {
+	double sd = 0;
+
+	if (timings.gap_count > 1) sd = sqrt(timings.gap_m2 / (timings.gap_count - 1));
+	printf("inter-transfer gap: mean %.1f us, stddev %.1f us, max %.1f us over %d gaps\n",
+		timings.gap_mean_ns / 1e3, sd / 1e3, (double) timings.gap_max_ns / 1e3, timings.gap_count);
+}
+
+
+/***************************/
+/*    Flash Farm Protocol    */
+/***************************/
+
+/*
+*  a coordinator reads jobs ("<mcu> <file.hex>" per line) from stdin and hands
+*  them to workers on the station hosts over a line based tcp protocol:
+*
+*	HELLO				-> STATION <name> <devices>
+*	STATUS				-> STATUS <devices>
+*	JOB <id> <sha256> <mcu>		-> ACCEPT <id>, or NEED <id> on a cache miss
+*	DATA <id> <size>, then the file	-> ACCEPT <id>
+*	(once the job has run)		<- DONE <id> <ok|error> <timings json>
+*
+*  workers cache images by their SHA-256, so a file only crosses the network
+*  on a cache miss. a transfer is streamed into the cache through a temporary
+*  file and only renamed into place if it has the announced digest, and a
+*  cached file is hashed again before every job that uses it. a worker runs one job at a time by re-executing itself with
+*  --timings=json and passes the timings back. a job goes to an idle station
+*  that reports a device, preferring untried stations and then the best
+*  measured throughput. --station=local forks a worker that runs every job
+*  with --dry-run, as a stand-in for tests. there is no authentication, so
+*  workers listen on loopback unless --listen names another address, which
+*  should only be on a trusted network. a station that leaves the
+*  coordinator waiting FARM_REPLY_MS for a reply, or for room to send, is
+*  counted as lost and its job runs elsewhere.
+*/
+#define FARM_LINE_MAX		4096
+#define FARM_POLL_MS		250
+#define FARM_REPLY_MS		5000
+#define FARM_JOB_ARGS		16	// 13 with every forwarded option
+/* largest valid hex text for a full image: one data byte per crlf record, plus address records */
+#define FARM_DATA_MAX		(15 * MAX_MEMORY_SIZE + 17 * (MAX_MEMORY_SIZE >> 16) + 13)
+
+struct farm_conn {
+	int	fd;
+	char	in[FARM_LINE_MAX];
+	size_t	in_len;
+};
+
+static bool farm_has_line(const struct farm_conn *c) {
+	return memchr(c->in, '\n', c->in_len) != NULL;
+}
+
+/* next line from c without the newline, waiting up to timeout_ms (-1: forever); false on eof, error or timeout */
+static bool farm_read_line(struct farm_conn *c, char *line, size_t len, int32_t timeout_ms) {
+	uint64_t deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000, now;
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+	char *nl;
+	ssize_t r;
+
+	while (!(nl = memchr(c->in, '\n', c->in_len))) {
+		if (c->in_len == sizeof(c->in)) return false;	// overlong line
+		if (timeout_ms >= 0) {
+			if ((now = monotonic_ns()) >= deadline) return false;
+			r = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) return false;
+		}
+		r = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		c->in_len += r;
+	}
+	*nl = '\0';
+	snprintf(line, len, "%s", c->in);
+	c->in_len -= nl + 1 - c->in;
+	memmove(c->in, nl + 1, c->in_len);
+	return true;
+}
+
+static bool farm_write(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool farm_printf(int fd, const char *format, ...) {
+	char line[FARM_LINE_MAX];
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	return n > 0 && n < (int) sizeof(line) && farm_write(fd, line, n);
+}
+
+
+/* Image Digest */
+
+#define ROR32(x, n)		(((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_HEX_LEN		64
+
+struct sha256 {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t	 buf[64];
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_init(struct sha256 *s) {
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->len = 0;
+}
+
+static void sha256_block(uint32_t *h, const uint8_t *p) {
+	uint32_t w[64], v[8], t1, t2;
+
+	for (int32_t i = 0; i < 16; i++) w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (int32_t i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+			(ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+	memcpy(v, h, sizeof(v));
+	for (int32_t i = 0; i < 64; i++) {
+		t1 = v[7] + (ROR32(v[4], 6) ^ ROR32(v[4], 11) ^ ROR32(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) +
+			sha256_k[i] + w[i];
+		t2 = (ROR32(v[0], 2) ^ ROR32(v[0], 13) ^ ROR32(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(v[0]));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (int32_t i = 0; i < 8; i++) h[i] += v[i];
+}
+
+static void sha256_update(struct sha256 *s, const uint8_t *p, size_t n) {
+	size_t fill = s->len % 64, take;
+
+	s->len += n;
+	if (fill) {
+		take = n < 64 - fill ? n : 64 - fill;
+		memcpy(s->buf + fill, p, take);
+		p += take;
+		n -= take;
+		if (fill + take < 64) return;
+		sha256_block(s->h, s->buf);
+	}
+	for (; n >= 64; p += 64, n -= 64) sha256_block(s->h, p);
+	memcpy(s->buf, p, n);
+}
+
+/* the digest as SHA256_HEX_LEN lowercase hex digits */
+static void sha256_final(struct sha256 *s, char *hex) {
+	uint64_t bits = s->len * 8;
+	uint8_t pad[72] = { 0x80 };
+	size_t n = (s->len % 64 < 56 ? 56 : 120) - s->len % 64;
+
+	for (int32_t i = 0; i < 8; i++) pad[n + i] = bits >> (56 - 8 * i);
+	sha256_update(s, pad, n + 8);
+	for (int32_t i = 0; i < 8; i++) sprintf(hex + 8 * i, "%08x", s->h[i]);
+}
+
+/* SHA-256 of the file contents in hex, false if it cannot be read */
+static bool file_sha256(const char *filename, char *hex) {
+	static uint8_t buf[65536];
+	struct sha256 s;
+	size_t n;
+	FILE *fp;
+
+	if (!(fp = fopen(filename, "rb"))) return false;
+	sha256_init(&s);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sha256_update(&s, buf, n);
+	n = ferror(fp);
+	fclose(fp);
+	sha256_final(&s, hex);
+	return !n;
+}
+
+
+/* Worker */
+
+static const char *farm_cache_dir(void) {
+	static char path[512];
+	const char *base;
+
+	if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+		snprintf(path, sizeof(path), "%s/teensy-loader", base);
+	} else {
+		base = getenv("HOME");
+		snprintf(path, sizeof(path), "%s/.cache", base && *base ? base : "/tmp");
+		mkdir(path, 0755);
+		strncat(path, "/teensy-loader", sizeof(path) - strlen(path) - 1);
+	}
+	mkdir(path, 0755);
+	return path;
+}
+
+/* a board this worker can flash: assumed when the job itself reboots or waits for one */
+static int32_t farm_devices(void) {
+	if (dry_run || wait_for_device_to_appear || teensy_hard_reboot_device || teensy_soft_reboot_device)
+		return 1;
+	if (!teensy_open()) return 0;
+	teensy_close();
+	return 1;
+}
+
+/* stream size bytes from c (the line buffer first) to path, kept only if they have the digest */
+static bool farm_receive(struct farm_conn *c, const char *path, const char *digest, int32_t size) {
+	static uint8_t buf[65536];
+	char tmp[1100], got[SHA256_HEX_LEN + 1];
+	struct sha256 s;
+	bool ok = true;
+	ssize_t n;
+	int fd;
+
+	if (size <= 0 || size > FARM_DATA_MAX) return false;
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) return false;
+	sha256_init(&s);
+	while (ok && size > 0) {
+		if (c->in_len) {
+			n = c->in_len < (size_t) size ? c->in_len : (size_t) size;
+			memcpy(buf, c->in, n);
+			c->in_len -= n;
+			memmove(c->in, c->in + n, c->in_len);
+		} else if ((n = read(c->fd, buf, size < (int32_t) sizeof(buf) ? size : (int32_t) sizeof(buf))) <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			break;
+		}
+		sha256_update(&s, buf, n);
+		ok = farm_write(fd, buf, n);
+		size -= n;
+	}
+	sha256_final(&s, got);
+	ok = !close(fd) && ok && !size && !strcmp(got, digest) && !rename(tmp, path);
+	if (!ok) unlink(tmp);
+	return ok;
+}
+
+/* flash path by re-executing this program; json gets its timings line */
+static bool farm_run_job(const char *mcu, const char *path, char *json, size_t json_len) {
+	char mcu_arg[64], metrics_arg[600], line[FARM_LINE_MAX - 64];
+	const char *args[FARM_JOB_ARGS];
+	int32_t n = 0, status;
+	int pipefd[2];
+	pid_t pid;
+	FILE *fp;
+
+	snprintf(mcu_arg, sizeof(mcu_arg), "--mcu=%s", mcu);
+	args[n++] = "teensy-loader";
+	args[n++] = mcu_arg;
+	args[n++] = "--timings=json";
+	if (dry_run) args[n++] = "--dry-run";
+	if (wait_for_device_to_appear) args[n++] = "-w";
+	if (teensy_hard_reboot_device) args[n++] = "-r";
+	if (teensy_soft_reboot_device) args[n++] = "-s";
+	if (!reboot_after_programming) args[n++] = "-n";
+	if (low_memory) args[n++] = "--low-memory";
+	if (hidraw_transport) args[n++] = "--transport=hidraw";
+	if (metrics_path) {
+		snprintf(metrics_arg, sizeof(metrics_arg), "--metrics=%s", metrics_path);
+		args[n++] = metrics_arg;
+	}
+	args[n++] = path;
+	if (n >= FARM_JOB_ARGS) die("farm job needs more than %d arguments", FARM_JOB_ARGS - 1);
+	args[n] = NULL;
+
+	snprintf(json, json_len, "{}");
+	if (pipe(pipefd) < 0) return false;
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return false;
+	}
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		execv("/proc/self/exe", (char **) args);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	fp = fdopen(pipefd[0], "r");
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '{') snprintf(json, json_len, "%s", line);
+	}
+	fclose(fp);
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void farm_worker_session(int fd) {
+	struct farm_conn c = { .fd = fd };
+	char line[FARM_LINE_MAX], json[FARM_LINE_MAX - 64], path[1024], mcu[32], host[64];
+	char digest[SHA256_HEX_LEN + 1], cached[SHA256_HEX_LEN + 1];
+	int32_t id, size;
+	bool ok;
+
+	while (farm_read_line(&c, line, sizeof(line), -1)) {
+		if (!strcmp(line, "HELLO")) {
+			if (gethostname(host, sizeof(host))) strcpy(host, "unknown");
+			host[sizeof(host) - 1] = '\0';
+			farm_printf(fd, "STATION %s %d\n", host, farm_devices());
+		} else if (!strcmp(line, "STATUS")) {
+			farm_printf(fd, "STATUS %d\n", farm_devices());
+		} else if (sscanf(line, "JOB %d %64[0-9a-f] %31s", &id, digest, mcu) == 3 && strlen(digest) == SHA256_HEX_LEN) {
+			snprintf(path, sizeof(path), "%s/%s.hex", farm_cache_dir(), digest);
+			if (!file_sha256(path, cached) || strcmp(cached, digest)) {	// missing, or not what its name says
+				printf_verbose("job %d: cache miss for %.16s\n", id, digest);
+				if (!farm_printf(fd, "NEED %d\n", id) || !farm_read_line(&c, line, sizeof(line), FARM_REPLY_MS) ||
+				    sscanf(line, "DATA %*d %d", &size) != 1 || !farm_receive(&c, path, digest, size)) {
+					fprintf(stderr, "job %d: image transfer failed\n", id);
+					return;
+				}
+			}
+			if (!farm_printf(fd, "ACCEPT %d\n", id)) return;
+			printf_verbose("job %d: flashing %s\n", id, mcu);
+			ok = farm_run_job(mcu, path, json, sizeof(json));
+			if (!farm_printf(fd, "DONE %d %s %s\n", id, ok ? "ok" : "error", json)) return;
+		} else {
+			farm_printf(fd, "ERROR unknown request\n");
+		}
+	}
+}
+
+int32_t farm_worker(const char *host, int32_t port) {
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	int one = 1, lfd = -1, fd, err;
+
+	signal(SIGPIPE, SIG_IGN);
+	snprintf(service, sizeof(service), "%d", port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	if ((err = getaddrinfo(host, service, &hints, &res)))
+		die("unable to listen on %s: %s", host, gai_strerror(err));
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((lfd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0) continue;
+		if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+		    bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(lfd, 4) == 0) break;
+		close(lfd);
+		lfd = -1;
+	}
+	freeaddrinfo(res);
+	if (lfd < 0) die("unable to listen on %s port %d: %s", host, port, strerror(errno));
+	printf_verbose("worker listening on %s port %d\n", host, port);
+	while (1) {	// one coordinator at a time
+		if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			die("accept: %s", strerror(errno));
+		}
+		printf_verbose("coordinator connected\n");
+		farm_worker_session(fd);
+		close(fd);
+	}
+}
+
+
+/* Coordinator */
+
+enum farm_job_state { JOB_PENDING, JOB_RUNNING, JOB_DONE };
+
+struct farm_job {
+	char	 mcu[32];
+	char	*file;
+	char	 digest[SHA256_HEX_LEN + 1];
+	int32_t	 size;
+	enum farm_job_state state;
+	uint64_t start_ns;
+	bool	 cache_miss;
+};
+
+struct farm_station {
+	const char *spec;
+	char	 name[64];
+	struct farm_conn conn;
+	int32_t	 devices;
+	int32_t	 job;		// running job, -1 when idle
+	int32_t	 jobs, failures, cache_misses;
+	double	 rate;		// hex bytes per second, moving average
+	bool	 dead;
+	pid_t	 pid;		// the --station=local worker, 0 for remote ones
+};
+
+/* sends that stall for FARM_REPLY_MS fail instead of blocking the coordinator */
+static int farm_send_timeout(int fd) {
+	struct timeval tv = { .tv_sec = FARM_REPLY_MS / 1000, .tv_usec = FARM_REPLY_MS % 1000 * 1000 };
+
+	if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+static int farm_connect(const char *spec, pid_t *pid) {
+	struct addrinfo hints, *res, *ai;
+	char host[256], *port;
+	int fd = -1, sv[2];
+
+	if (!strcmp(spec, "local")) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+		fflush(stdout);
+		if ((*pid = fork()) == 0) {
+			close(sv[0]);
+			dry_run = true;
+			farm_worker_session(sv[1]);
+			_exit(0);
+		}
+		close(sv[1]);
+		if (*pid < 0) {
+			*pid = 0;
+			close(sv[0]);
+			return -1;
+		}
+		return farm_send_timeout(sv[0]);
+	}
+	snprintf(host, sizeof(host), "%s", spec);
+	if (!(port = strrchr(host, ':'))) return -1;
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) return -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0) continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return farm_send_timeout(fd);
+}
+
+static void farm_station_lost(struct farm_station *st, struct farm_job *jobs) {
+	fprintf(stderr, "station %s lost\n", st->spec);
+	if (st->job >= 0) jobs[st->job].state = JOB_PENDING;	// run it elsewhere
+	st->job = -1;
+	st->dead = true;
+	close(st->conn.fd);
+	if (st->pid > 0) kill(st->pid, SIGTERM);	// reaped at the end
+}
+
+/* DATA for job id: the size, then the file streamed as it is read */
+static bool farm_send_file(int fd, int32_t id, const struct farm_job *job) {
+	static uint8_t buf[65536];
+	int32_t left = job->size;
+	size_t n;
+	bool ok;
+	FILE *fp;
+
+	if (!(fp = fopen(job->file, "rb"))) return false;
+	ok = farm_printf(fd, "DATA %d %d\n", id, job->size);
+	while (ok && left > 0 && (n = fread(buf, 1, left < (int32_t) sizeof(buf) ? left : (int32_t) sizeof(buf), fp)) > 0) {
+		ok = farm_write(fd, buf, n);
+		left -= n;
+	}
+	fclose(fp);
+	return ok && !left;
+}
+
+/* hand jobs[index] to st, shipping the image if the station does not have it */
+static bool farm_start_job(struct farm_station *st, struct farm_job *job, int32_t index) {
+	int32_t id = index + 1;
+	char line[FARM_LINE_MAX];
+	int32_t r;
+
+	if (!farm_printf(st->conn.fd, "JOB %d %s %s\n", id, job->digest, job->mcu) ||
+	    !farm_read_line(&st->conn, line, sizeof(line), FARM_REPLY_MS))
+		return false;
+	job->cache_miss = sscanf(line, "NEED %d", &r) == 1;
+	if (job->cache_miss) {
+		st->cache_misses++;
+		if (!farm_send_file(st->conn.fd, id, job) || !farm_read_line(&st->conn, line, sizeof(line), FARM_REPLY_MS))
+			return false;
+	}
+	if (sscanf(line, "ACCEPT %d", &r) != 1 || r != id) return false;
+	job->state = JOB_RUNNING;
+	job->start_ns = monotonic_ns();
+	st->job = index;
+	return true;
+}
+
+static bool farm_finish_job(struct farm_station *st, struct farm_job *job, int32_t index, const char *line) {
+	int32_t id = index + 1;
+	char result[8];
+	double wall_s = (monotonic_ns() - job->start_ns) / 1e9;
+	int32_t r, off = 0;
+
+	if (sscanf(line, "DONE %d %7s %n", &r, result, &off) != 2 || r != id) strcpy(result, "error");
+	job->state = JOB_DONE;
+	st->job = -1;
+	st->jobs++;
+	if (strcmp(result, "ok")) st->failures++;
+	else if (wall_s > 0) st->rate = st->rate ? 0.7 * st->rate + 0.3 * job->size / wall_s : job->size / wall_s;
+
+	if (timings_json) {
+		printf("{\"job\":%d,\"mcu\":\"%s\",\"file\":\"%s\",\"station\":\"%s\",\"result\":\"%s\","
+			"\"wall_s\":%.6f,\"cache\":\"%s\",\"timings\":%s}\n",
+			id, job->mcu, job->file, st->spec, result, wall_s, job->cache_miss ? "miss" : "hit",
+			off ? line + off : "{}");
+	} else {
+		printf("job %d: %s %s on %s: %s in %.3f s (cache %s)\n", id, job->mcu, job->file,
+			st->spec, result, wall_s, job->cache_miss ? "miss" : "hit");
+	}
+	fflush(stdout);
+	return !strcmp(result, "ok");
+}
+
+/* the idle station with a device that should get the next job, or NULL */
+static struct farm_station *farm_pick_station(struct farm_station *st, int32_t n) {
+	struct farm_station *best = NULL;
+
+	for (int32_t i = 0; i < n; i++) {
+		if (st[i].dead || st[i].job >= 0 || st[i].devices <= 0) continue;
+		if (!best || (best->jobs && !st[i].jobs) || (!best->jobs == !st[i].jobs && st[i].rate > best->rate))
+			best = &st[i];
+	}
+	return best;
+}
+
+int32_t farm_coordinator(void) {
+	struct farm_station st[FARM_MAX_STATIONS];
+	struct farm_job *jobs = NULL, *job;
+	struct pollfd pfd[FARM_MAX_STATIONS];
+	struct farm_station *pick, *polled[FARM_MAX_STATIONS];
+	char line[FARM_LINE_MAX], mcu[32], file[1024], name[64];
+	int32_t njobs = 0, done = 0, failed = 0, live, npoll, next;
+	struct stat sb;
+
+	if (!station_count) usage("--coordinator needs at least one --station");
+	signal(SIGPIPE, SIG_IGN);
+	while (fgets(line, sizeof(line), stdin)) {
+		if (line[0] == '#' || sscanf(line, "%31s %1023s", mcu, file) != 2) continue;
+		if (!(jobs = realloc(jobs, sizeof(*jobs) * (njobs + 1)))) die("out of memory");
+		job = &jobs[njobs++];
+		memset(job, 0, sizeof(*job));
+		snprintf(job->mcu, sizeof(job->mcu), "%s", mcu);
+		job->file = strdup(file);
+		if (stat(file, &sb) < 0 || sb.st_size <= 0 || sb.st_size > FARM_DATA_MAX || !file_sha256(file, job->digest))
+			die("unable to read \"%s\"", file);
+		job->size = sb.st_size;
+	}
+
+	for (int32_t i = 0; i < station_count; i++) {
+		memset(&st[i], 0, sizeof(st[i]));
+		st[i].spec = stations[i];
+		st[i].job = -1;
+		st[i].conn.fd = farm_connect(stations[i], &st[i].pid);
+		if (st[i].conn.fd < 0 || !farm_printf(st[i].conn.fd, "HELLO\n") ||
+		    !farm_read_line(&st[i].conn, line, sizeof(line), FARM_REPLY_MS) ||
+		    sscanf(line, "STATION %63s %d", name, &st[i].devices) != 2) {
+			fprintf(stderr, "station %s unreachable\n", stations[i]);
+			if (st[i].conn.fd >= 0) close(st[i].conn.fd);
+			st[i].dead = true;
+			continue;
+		}
+		snprintf(st[i].name, sizeof(st[i].name), "%s", name);
+		printf_verbose("station %s: %s, %d device(s)\n", st[i].spec, st[i].name, st[i].devices);
+	}
+
+	while (done < njobs) {
+		/* refresh idle stations, then place pending jobs, best station first */
+		live = 0;
+		for (int32_t i = 0; i < station_count; i++) {
+			if (st[i].dead) continue;
+			live++;
+			if (st[i].job >= 0) continue;
+			if (!farm_printf(st[i].conn.fd, "STATUS\n") || !farm_read_line(&st[i].conn, line, sizeof(line), FARM_REPLY_MS) ||
+			    sscanf(line, "STATUS %d", &st[i].devices) != 1)
+				farm_station_lost(&st[i], jobs);
+		}
+		if (!live) die("no stations left, %d of %d jobs done", done, njobs);
+		for (next = 0; next < njobs; next++) {
+			if (jobs[next].state != JOB_PENDING) continue;
+			if (!(pick = farm_pick_station(st, station_count))) break;
+			if (!farm_start_job(pick, &jobs[next], next)) farm_station_lost(pick, jobs);
+		}
+
+		/* collect results; the timeout doubles as the device re-poll interval */
+		npoll = 0;
+		for (int32_t i = 0; i < station_count; i++) {
+			if (st[i].dead || st[i].job < 0) continue;
+			polled[npoll] = &st[i];
+			pfd[npoll].fd = st[i].conn.fd;
+			pfd[npoll++].events = POLLIN;
+		}
+		if (poll(pfd, npoll, FARM_POLL_MS) < 0 && errno != EINTR) die("poll: %s", strerror(errno));
+		for (int32_t i = 0; i < npoll; i++) {
+			if (!pfd[i].revents && !farm_has_line(&polled[i]->conn)) continue;
+			next = polled[i]->job;
+			if (!farm_read_line(&polled[i]->conn, line, sizeof(line), FARM_REPLY_MS)) {
+				farm_station_lost(polled[i], jobs);
+				continue;
+			}
+			if (!farm_finish_job(polled[i], &jobs[next], next, line)) failed++;
+			done++;
+		}
+	}
+
+	for (int32_t i = 0; i < station_count; i++) {	// local workers share each other's sockets, so no eof
+		if (!st[i].dead) close(st[i].conn.fd);
+		if (st[i].pid <= 0) continue;
+		kill(st[i].pid, SIGTERM);
+		while (waitpid(st[i].pid, NULL, 0) < 0 && errno == EINTR);
+	}
+	if (!timings_json) {
+		for (int32_t i = 0; i < station_count; i++) {
+			printf("station %s: %d jobs, %d failed, %d cache misses, %.1f kB/s%s\n", st[i].spec,
+				st[i].jobs, st[i].failures, st[i].cache_misses, st[i].rate / 1000, st[i].dead ? " (lost)" : "");
+		}
+	}
+	return failed ? 1 : 0;
+}
+
+
+/************************************/
+/*    Shared-Memory Status Page    */
+/************************************/
+
+/*
+*  with --status every flashing process claims a slot in a fixed-layout page
+*  in the user's private /dev/shm directory (the one the shared images use)
+*  and publishes its progress there under a per-slot seqlock: the writer
+*  makes the sequence odd, copies the record, then makes it even again,
+*  which is a handful of stores per block and never a syscall. readers
+*  map the page and retry a slot whose sequence was odd or moved while they
+*  copied it, so any number of them can watch without blocking the writer.
+*  a slot belongs to a pid; once that process is gone its final state stays
+*  visible until a new process reuses the slot. a writer killed mid-publish
+*  leaves its sequence odd: readers give up on such a slot after
+*  STATUS_READ_TRIES and show it as stale, and the next owner evens it out
+*  when it claims the slot.
+*/
+#define STATUS_NAME		"status"
+#define STATUS_MAGIC		0x54534c54	// "TLST"
+#define STATUS_VERSION		1
+#define STATUS_SLOTS		64
+#define STATUS_READ_TRIES	1000	// before a slot counts as stale
+
+enum status_result { STATUS_RUNNING, STATUS_OK, STATUS_ERROR };
+
+struct status_record {
+	int32_t	 phase;		// enum timing_phase
+	int32_t	 result;	// enum status_result
+	int32_t	 blocks_done;
+	int32_t	 blocks_total;
+	int64_t	 bytes;
+	uint64_t latency_ns;	// last block write
+	int32_t	 retries;
+	int32_t	 reserved;
+	uint64_t updated_ns;	// CLOCK_MONOTONIC
+	char	 mcu[24];
+	char	 file[40];
+};
+
+struct status_slot {
+	_Atomic uint32_t seq;	// odd while the owner is writing
+	_Atomic int32_t	 pid;	// owner, 0 if never used
+	struct status_record rec;
+} __attribute__((aligned(64)));	// slots never share a cache line
+
+struct status_page_layout {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+	struct status_slot slot[STATUS_SLOTS];
+};
+
+static struct status_slot	*status_slot = NULL;
+static struct status_record	 status_rec;
+
+/* the page in the private directory, trusted only while it is a file of ours that no one else can open */
+static struct status_page_layout *status_map(bool create, char *path, size_t len) {
+	struct status_page_layout *page;
+	struct stat st;
+	int fd;
+
+	if (!private_shm_dir(path, len, "no status page")) return NULL;
+	strncat(path, "/" STATUS_NAME, len - strlen(path) - 1);
+	fd = create ? open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600) :
+		open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) ||
+	    (create && st.st_size < (off_t) sizeof(*page) && ftruncate(fd, sizeof(*page)) < 0) ||
+	    (!create && st.st_size < (off_t) sizeof(*page))) {
+		close(fd);
+		return NULL;
+	}
+	page = mmap(NULL, sizeof(*page), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) return NULL;
+	if (create && page->magic == 0) {	// first user fills in the header
+		page->version = STATUS_VERSION;
+		page->slots = STATUS_SLOTS;
+		page->slot_size = sizeof(struct status_slot);
+		__atomic_store_n(&page->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATUS_MAGIC || page->version != STATUS_VERSION ||
+	    page->slot_size != sizeof(struct status_slot)) {
+		munmap(page, sizeof(*page));
+		return NULL;
+	}
+	return page;
+}
+
+static void status_publish(void) {
+	uint32_t seq;
+
+	if (!status_slot) return;
+	status_rec.retries = timings.write_retries;
+	status_rec.bytes = timings.bytes_written;
+	status_rec.updated_ns = monotonic_ns();
+	seq = atomic_load_explicit(&status_slot->seq, memory_order_relaxed) | 1;
+	atomic_store_explicit(&status_slot->seq, seq, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&status_slot->rec, &status_rec, sizeof(status_rec));
+	atomic_store_explicit(&status_slot->seq, seq + 1, memory_order_release);
+}
+
+static void status_exit(void) {
+	status_rec.result = timings.success ? STATUS_OK : STATUS_ERROR;
+	status_publish();
+}
+
+void status_open(void) {
+	struct status_page_layout *page;
+	int32_t pid = getpid(), owner;
+	char path[1024];
+	const char *base;
+	uint32_t seq;
+
+	if (!(page = status_map(true, path, sizeof(path)))) {
+		fprintf(stderr, "unable to open status page \"%s\"\n", path);
+		return;
+	}
+	for (int32_t i = 0; i < STATUS_SLOTS && !status_slot; i++) {	// free slot, or one whose owner is gone
+		owner = atomic_load(&page->slot[i].pid);
+		if (owner && (owner == pid || kill(owner, 0) == 0 || errno != ESRCH)) continue;
+		if (atomic_compare_exchange_strong(&page->slot[i].pid, &owner, pid)) status_slot = &page->slot[i];
+	}
+	if (!status_slot) {
+		fprintf(stderr, "status page full, not publishing progress\n");
+		return;
+	}
+	seq = atomic_load_explicit(&status_slot->seq, memory_order_relaxed);
+	if (seq & 1) atomic_store_explicit(&status_slot->seq, seq + 1, memory_order_release);	// previous owner died mid-publish
+	memset(&status_rec, 0, sizeof(status_rec));
+	snprintf(status_rec.mcu, sizeof(status_rec.mcu), "%s", mcu_name ? mcu_name : "");
+	base = filename ? strrchr(filename, '/') : NULL;
+	snprintf(status_rec.file, sizeof(status_rec.file), "%s", base ? base + 1 : filename ? filename : "");
+	status_rec.phase = PHASE_PARSE;
+	status_publish();
+	atexit(status_exit);
+}
+
+void status_phase(enum timing_phase phase) {
+	if (!status_slot) return;
+	status_rec.phase = phase;
+	status_publish();
+}
+
+void status_block(int32_t done, int32_t total, uint64_t latency_ns) {
+	if (!status_slot) return;
+	status_rec.phase = PHASE_WRITE;
+	status_rec.blocks_done = done;
+	status_rec.blocks_total = total;
+	status_rec.latency_ns = latency_ns;
+	status_publish();
+}
+
+/* consistent copy of a slot: 1, 0 if it was never used, -1 if it never settled (only the pid is valid) */
+static int32_t status_read(const struct status_slot *slot, int32_t *pid, struct status_record *rec) {
+	uint32_t s1, s2;
+
+	for (int32_t tries = 0; tries < STATUS_READ_TRIES; tries++) {
+		s1 = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		*pid = atomic_load_explicit(&slot->pid, memory_order_relaxed);
+		if (s1 & 1) continue;
+		memcpy(rec, &slot->rec, sizeof(*rec));
+		atomic_thread_fence(memory_order_acquire);
+		s2 = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+		if (s1 == s2) return *pid != 0 && s1 != 0;
+	}
+	return -1;
+}
+
+int32_t status_watch(int32_t interval_ms) {
+	static const char *results[] = { "running", "ok", "error" };
+	struct status_page_layout *page;
+	struct status_record rec;
+	bool tty = isatty(STDOUT_FILENO);
+	uint64_t now;
+	char path[1024];
+	int32_t pid, r;
+
+	if (!(page = status_map(false, path, sizeof(path))))
+		die("no status page at \"%s\" (start a flash with --status)", path);
+	while (1) {
+		if (tty && interval_ms) printf("\033[H\033[J");
+		printf("%-4s %-8s %-16s %-20s %-7s %-7s %11s %10s %7s %7s\n", "slot", "pid", "mcu", "file",
+			"phase", "state", "blocks", "latency_us", "retries", "age_s");
+		now = monotonic_ns();
+		for (int32_t i = 0; i < STATUS_SLOTS; i++) {
+			if (!(r = status_read(&page->slot[i], &pid, &rec))) continue;
+			if (r < 0) {
+				printf("%-4d %-8d %-16s %-20s %-7s %-7s\n", i, pid, "", "", "", "stale");
+				continue;
+			}
+			printf("%-4d %-8d %-16.16s %-20.20s %-7s %-7s %5d/%-5d %10.1f %7d %7.1f\n", i, pid, rec.mcu, rec.file,
+				rec.phase >= 0 && rec.phase < PHASE_COUNT ? timing_phase_names[rec.phase] : "?",
+				rec.result >= 0 && rec.result <= STATUS_ERROR ? results[rec.result] : "?",
+				rec.blocks_done, rec.blocks_total, rec.latency_ns / 1e3, rec.retries,
+				(now - rec.updated_ns) / 1e9);
+		}
+		fflush(stdout);
+		if (!interval_ms) return 0;
+		usleep(interval_ms * 1000);
+	}
+}
+
+
+/********************/
+/*    Watch Mode    */
+/********************/
+
+/*
+*  --watch keeps an inotify watch on the hex file's directory rather than on
+*  the file itself, so linkers and editors that write a temporary file and
+*  rename it over the old one are seen (IN_MOVED_TO) as well as in-place
+*  writes (IN_CLOSE_WRITE, i.e. once the writer is done). events that follow
+*  within WATCH_SETTLE_MS restart the wait, for tools that write in several
+*  passes. the next flash then soft-reboots the board and polls for HalfKay
+*  every WATCH_POLL_US instead of the usual 250 ms. every flash is reported
+*  (--timings=json, --metrics) as a run of its own, timed from the rewrite.
+*  SIGINT and SIGTERM only set watch_stop and write to a pipe that the wait
+*  polls next to the inotify fd; the wait, the open loop and the block loop
+*  all check the flag, and main returns through its usual path, so the
+*  atexit reports still cover a flash the signal cut short.
+*/
+#define WATCH_SETTLE_MS		20
+
+static int	 watch_fd = -1;
+static int	 watch_pipe[2] = { -1, -1 };	// written by the signal handler
+static char	 watch_name[256];
+
+static void watch_signal(int sig) {
+	int saved = errno;
+	ssize_t r;
+
+	watch_stop = sig;
+	r = write(watch_pipe[1], "", 1);
+	(void) r;
+	errno = saved;
+}
+
+void watch_init(const char *path) {
+	struct sigaction sa = { .sa_handler = watch_signal, .sa_flags = SA_RESETHAND };	// no SA_RESTART; a second signal kills
+	char dir[1024], *slash;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if ((slash = strrchr(dir, '/'))) {
+		*slash = '\0';
+		snprintf(watch_name, sizeof(watch_name), "%s", slash + 1);
+		if (!*dir) strcpy(dir, "/");
+	} else {
+		snprintf(watch_name, sizeof(watch_name), "%s", path);
+		strcpy(dir, ".");
+	}
+	if ((watch_fd = inotify_init1(IN_CLOEXEC)) < 0 ||
+	    inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		die("unable to watch \"%s\": %s", dir, strerror(errno));
+	if (pipe2(watch_pipe, O_NONBLOCK | O_CLOEXEC) < 0) die("pipe: %s", strerror(errno));
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+/* report the flash that just finished and start counting the next one */
+void watch_run_done(void) {
+	if (timings_json) timings_print_json();
+	if (metrics_path) metrics_write();
+	events_flush();
+	memset(&timings, 0, sizeof(timings));
+	memset(run_hist, 0, sizeof(run_hist));	// health_update merged them already
+	timings.idle = true;
+}
+
+/* read the batch of events poll reported; true if one was for the hex file */
+static bool watch_read_events(void) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool matched = false;
+	ssize_t n;
+
+	while ((n = read(watch_fd, buf, sizeof(buf))) < 0 && errno == EINTR);
+	if (n <= 0) die("inotify: %s", n ? strerror(errno) : "end of file");
+	for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *) p;
+		if (ev->len && !strcmp(ev->name, watch_name)) matched = true;
+	}
+	return matched;
+}
+
+/* true once inotify has events, false on timeout, a signal or watch_stop */
+static bool watch_poll(int32_t timeout_ms) {
+	struct pollfd pfd[2] = { { .fd = watch_fd, .events = POLLIN }, { .fd = watch_pipe[0], .events = POLLIN } };
+
+	return poll(pfd, 2, timeout_ms) > 0 && (pfd[0].revents & POLLIN) && !watch_stop;
+}
+
+/* block until the hex file has been rewritten and settled, returns when that happened (0 if stopped) */
+static uint64_t watch_wait(void) {
+	uint64_t change_ns;
+
+	printf_verbose("watching \"%s\" for changes...\n", filename);
+	while (!watch_stop && !(watch_poll(-1) && watch_read_events()));
+	if (watch_stop) return 0;
+	change_ns = monotonic_ns();
+	while (watch_poll(WATCH_SETTLE_MS)) {
+		if (watch_read_events()) change_ns = monotonic_ns();
+	}
+	if (watch_stop) return 0;
+	timings.start_ns = change_ns;	// the next run
+	timings.idle = false;
+	event_emit("file_changed", "");
+	return change_ns;
+}
+
+/* wait for the next good build and load it, returns when it was written (0 if stopped) */
+uint64_t watch_reload(void) {
+	uint64_t change_ns, t;
+	int32_t num;
+
+	while (1) {
+		if (!(change_ns = watch_wait())) return 0;
+		t = timing_begin(PHASE_PARSE);
+		num = image_load(filename);
+		timing_add(PHASE_PARSE, t);
+		if (num >= 0) break;
+		fprintf(stderr, "error reading intel hex file \"%s\", waiting for the next build\n", filename);
+	}
+	printf_verbose("read \"%s\": %d bytes, %.1f%% usage\n",
+		filename, num, (double) num / (double) code_size * 100.0);
+	return change_ns;
+}
+
+/* main's way out once watch_stop is set: the atexit reports cover a flash it cut short */
+int32_t watch_stopped(void) {
+	if (!timings.idle) timings.error_cause = "interrupted";
+	printf_verbose("stopped by signal %d\n", (int) watch_stop);
+	return 128 + watch_stop;
+}
+
+
+/********************************/
+/*    Device Permission Wait    */
+/********************************/
+
+/*
+*  a freshly enumerated HalfKay node is root-only until udev applies
+*  00-teensy.rules. the open paths report such a node with perm_denied
+*  (libusb would otherwise open usbfs read-only and fail on the first
+*  write), and instead of sleeping a full poll interval the wait loop keeps
+*  an inotify watch on the node: the chmod or acl change udev makes raises
+*  IN_ATTRIB, so the next open follows it immediately. the node is checked
+*  after the watch is added, so a change in between is not missed.
+*/
+static char	 perm_node[512];		// node that refused us, "" if none
+static uint64_t	 perm_denied_ns;	// when it first did
+
+void perm_denied(const char *node) {
+	if (!strcmp(node, perm_node)) return;
+	snprintf(perm_node, sizeof(perm_node), "%s", node);
+	perm_denied_ns = monotonic_ns();
+	printf_verbose("no permission to open %s yet, waiting for udev\n", node);
+}
+
+const char *perm_pending(void) {
+	return perm_node[0] ? perm_node : NULL;
+}
+
+/* sleep until the pending node grants access or timeout_us passes; false if no node is pending */
+bool perm_wait(useconds_t timeout_us) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	uint64_t deadline = monotonic_ns() + timeout_us * 1000ULL, now;
+	struct pollfd pfd = { .events = POLLIN };
+
+	if (!perm_node[0]) return false;
+	if ((pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0) return false;
+	if (inotify_add_watch(pfd.fd, perm_node, IN_ATTRIB | IN_DELETE_SELF) < 0) {	// gone already
+		close(pfd.fd);
+		perm_node[0] = '\0';
+		return false;
+	}
+	while (access(perm_node, R_OK | W_OK) && errno == EACCES && (now = monotonic_ns()) < deadline) {
+		if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) > 0) {
+			while (read(pfd.fd, buf, sizeof(buf)) > 0);
+		}
+	}
+	close(pfd.fd);
+	return true;
+}
+
+/* the device opened: report how long udev kept us waiting, if it did */
+void perm_granted(void) {
+	if (!perm_node[0]) return;
+	timings.permission_wait_ns = monotonic_ns() - perm_denied_ns;
+	printf_verbose("permissions on %s granted after %.1f ms\n",
+		perm_node, timings.permission_wait_ns / 1e6);
+	perm_node[0] = '\0';
+}